@@ -4,14 +4,102 @@ this monstrosity deserves to sweat after  what it did to me
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>      // Include this header for time()
+// Compile with -DREALMALLOC to time the C library's malloc (or a preloaded one) instead of mymalloc()
+#ifndef REALMALLOC
 #include "mymalloc.h"
+#define ALLOCATOR "mymalloc"
+#else
+#define ALLOCATOR "libc"
+typedef struct mymalloc_stats mymalloc_stats;  // Only mymalloc can take a snapshot
+#endif
 
 
 #define RUNS 50  // Number of times each workload will be executed for timing purposes
+#define WARMUP_RUNS 5  // Untimed runs before the timed ones
+#define MAX_REPETITIONS 100000  // Most timed runs a workload can be given with -r
+#define FRAG_BLOCKS 1000  // Blocks live at once in workload 9
+#define SPREAD_BLOCKS 16384  // 1000-byte blocks workload 10 spreads over about 16 MB
+#define SPREAD_TOUCHES (SPREAD_BLOCKS * 16)  // Random blocks workload 10 writes to
+#define SPREAD_RUNS 10  // Workload 10 takes milliseconds, so it is timed fewer times
+#define THREADS 4  // Threads in workloads 11 to 14, except in the scaling sweep
+#define MAX_THREADS 256  // Most threads the sweep goes up to
+#define THREAD_RUNS 10  // Runs of workloads 11 to 14, which take milliseconds each
+#define CHURN_WINDOW 64  // Blocks each thread of workload 11 keeps live
+#define CHURN_OPS 20000  // Blocks each thread of workload 11 replaces
+#define QUEUE_SLOTS 256  // Blocks in flight between a producer and its consumer in workload 12
+#define HANDOFF_BLOCKS 20000  // Blocks each producer of workload 12 passes on
+#define LARSON_SLOTS 1000  // Blocks each thread of workload 13 holds
+#define LARSON_OPS 5000  // Blocks each thread of workload 13 replaces per round
+#define LARSON_ROUNDS 4  // Generations of threads in workload 13
+#define COUNTER_ROUNDS 100  // Counters each thread of workload 14 allocates
+#define COUNTER_INCREMENTS 10000  // Stores to each counter
+
+#define FORMAT_TEXT 0  // A table in microseconds
+#define FORMAT_CSV 1   // Comma-separated rows in nanoseconds
+#define FORMAT_JSON 2  // One JSON object per line, in nanoseconds
+#define CSV_FIELDS 13  // Columns of a CSV row, as read back by 'compare_with'
+
+/*
+ * A workload as the harness sees it: its name, the function that runs it
+ * once, how many timed runs it gets unless -r says otherwise, and how many
+ * allocator calls one run makes, from which its throughput is worked out.
+ * For a threaded workload 'ops' counts the calls of one thread.
+ */
+typedef struct workload {
+    const char *name;
+    void (*run)();
+    int runs;
+    int ops;
+    bool threaded;
+} workload;
+
+/*
+ * The spread of one workload's run times, in nanoseconds. 'setting' names the
+ * allocator setting a comparison ran it under ("" for none). The throughput is
+ * taken at the median, and the peak RSS is that of the process the workload ran
+ * in. 'fragmentation' is negative unless the placement policy comparison measured it.
+ */
+typedef struct result {
+    const char *allocator;
+    const char *workload;
+    const char *setting;
+    int runs;
+    long long min;
+    long long median;
+    long long p99;
+    long long max;
+    long long mean;
+    double ops_per_sec;
+    long peak_rss_kb;
+    double fragmentation;
+    size_t heap_bytes;
+} result;
+
+static int repetitions;  // Timed runs per workload from -r; 0 keeps each workload's own
+static int warmups = WARMUP_RUNS;
+static int format = FORMAT_TEXT;
+static const char *allocator = ALLOCATOR;  // Named in every result
+static int thread_count = THREADS;         // Threads the threaded workloads start
+static int max_threads;                    // Where the scaling sweep stops, from -t or the CPU count
+static int threads_started;                // By the last run of a threaded workload
+static atomic_int layout_run;              // Run being timed, counted from 1; 0 during the warm-up
+static _Atomic long long layout_last_ns;   // Time of the last run that finished
+#ifndef REALMALLOC
+static int layout_interval;                // Microseconds between heap layouts from -l; 0 for none
+static const char *layout_workload;        // The only workload -L gives layouts to; NULL for every one
+static atomic_bool layout_stop;
+#endif
 
 /*
  * Function: workload1
@@ -259,91 +347,937 @@ void workload8() {
 }
 
 /*
- * Function: main
- * --------------
- * Runs each workload multiple times and measures the average execution time.
+ * Function: workload9
+ * -------------------
+ * Workload 9 fragments the heap with blocks too big for the thread caches, so every
+ * request is placed by the allocator's placement policy.
  *
  * Steps:
- * 1. Seed the random number generator using srand.
- * 2. For each workload:
- *    a. Use gettimeofday to record the start time.
- *    b. Loop RUNS times to execute the workload.
- *    c. Use gettimeofday to record the end time.
- *    d. Calculate the average execution time in microseconds.
- *    e. Print the execution time for the workload.
+ * 1. Allocate FRAG_BLOCKS blocks of random sizes between 257 and 2304 bytes.
+ * 2. Free every other block, leaving holes of mixed sizes between the survivors.
+ * 3. Refill the holes with blocks of random sizes between 257 and 4352 bytes, which
+ *    only sometimes fit where the old ones were.
+ * 4. If 'snapshot' is not NULL, take the allocator's stats while the heap is at its fullest.
+ * 5. Free every block.
  *
  * Purpose:
- * - Measures the performance of the allocator under different workloads.
- * - Provides insights into execution times for various memory usage patterns.
+ * - Shows how well a placement policy reuses holes: a poor one leaves more free bytes
+ *   scattered outside the largest free chunk, and maps more memory.
  */
-int main() {
-    struct timeval start, end;
+void workload9(mymalloc_stats *snapshot) {
+    static void *ptrs[FRAG_BLOCKS];
+    for (int i = 0; i < FRAG_BLOCKS; i++) {
+        ptrs[i] = malloc(rand() % 2048 + 257);
+    }
+    for (int i = 0; i < FRAG_BLOCKS; i += 2) {
+        free(ptrs[i]);
+    }
+    for (int i = 0; i < FRAG_BLOCKS; i += 2) {
+        ptrs[i] = malloc(rand() % 4096 + 257);
+    }
+#ifndef REALMALLOC
+    if (snapshot) {
+        mymalloc_get_stats(snapshot);
+    }
+#endif
+    for (int i = 0; i < FRAG_BLOCKS; i++) {
+        free(ptrs[i]);
+    }
+}
 
-    srand((unsigned int)time(NULL)); // Seed the random number generator
+/*
+ * Function: workload10
+ * --------------------
+ * Workload 10 spreads blocks over more memory than the TLB covers and writes to them
+ * in random order, so most writes need a page walk unless the heap sits on huge pages.
+ *
+ * Steps:
+ * 1. Allocate SPREAD_BLOCKS blocks of 1000 bytes, too big for the thread caches.
+ * 2. Write to SPREAD_TOUCHES blocks picked at random, with a linear congruential
+ *    generator rather than rand() so that the writes and not the generator dominate.
+ * 3. Free every block.
+ *
+ * Purpose:
+ * - Shows what backing the arenas with huge pages and binding them to the
+ *   allocating thread's NUMA node does for a program that walks a large heap.
+ */
+void workload10() {
+    static char *blocks[SPREAD_BLOCKS];
+    for (int i = 0; i < SPREAD_BLOCKS; i++) {
+        blocks[i] = malloc(1000);
+        blocks[i][0] = 0;
+    }
+    uint32_t state = (uint32_t)rand();
+    for (int i = 0; i < SPREAD_TOUCHES; i++) {
+        state = state * 1664525u + 1013904223u;
+        blocks[(state >> 8) % SPREAD_BLOCKS][i % 1000]++;
+    }
+    for (int i = 0; i < SPREAD_BLOCKS; i++) {
+        free(blocks[i]);
+    }
+}
 
-    // Measure time for workload 1
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload1();
+/*
+ * Function: next_random
+ * ---------------------
+ * Steps a thread's own linear congruential generator and returns its upper bits.
+ * The threaded workloads use it instead of rand(), whose hidden lock every thread
+ * would queue on.
+ */
+uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+/*
+ * Function: run_threads
+ * ---------------------
+ * Starts 'count' threads running 'body', each given its index, and waits for all of them.
+ * Records the count in 'threads_started' for the throughput.
+ */
+void run_threads(int count, void *(*body)(void *)) {
+    pthread_t ids[MAX_THREADS];
+    threads_started = count;
+    for (int i = 0; i < count; i++) {
+        pthread_create(&ids[i], NULL, body, (void*)(intptr_t)i);
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 1: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    for (int i = 0; i < count; i++) {
+        pthread_join(ids[i], NULL);
+    }
+}
 
-    // Measure time for workload 2
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload2();
+/*
+ * Function: churn_thread
+ * ----------------------
+ * Body of workload 11: keeps CHURN_WINDOW blocks of 16 to 1024 bytes and replaces
+ * a random one of them CHURN_OPS times, then frees the rest.
+ */
+void *churn_thread(void *arg) {
+    void *window[CHURN_WINDOW] = { NULL };
+    uint32_t state = (uint32_t)(intptr_t)arg * 2654435761u + 1;
+    for (int i = 0; i < CHURN_OPS; i++) {
+        int slot = next_random(&state) % CHURN_WINDOW;
+        free(window[slot]);
+        window[slot] = malloc(next_random(&state) % 1009 + 16);
+        *(char*)window[slot] = (char)i;
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 2: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    for (int slot = 0; slot < CHURN_WINDOW; slot++) {
+        free(window[slot]);
+    }
+    return NULL;
+}
 
-    // Measure time for workload 3
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload3();
+/*
+ * Function: workload11
+ * --------------------
+ * Workload 11 runs 'thread_count' threads that each churn through blocks of their own.
+ *
+ * Steps:
+ * 1. Start the threads, each running 'churn_thread'.
+ * 2. Wait for them all.
+ *
+ * Purpose:
+ * - Shows how allocation scales when threads share nothing but the allocator, which
+ *   is where per-thread caches should keep them off the heap lock.
+ */
+void workload11() {
+    run_threads(thread_count, churn_thread);
+}
+
+/*
+ * A bounded queue of blocks from one producer thread to one consumer thread.
+ * Each index is written by one side only, and they sit on cache lines of
+ * their own so the two threads do not fight over one line.
+ */
+typedef struct handoff_queue {
+    alignas(64) void *slots[QUEUE_SLOTS];
+    alignas(64) atomic_uint head;  // Next slot the consumer takes
+    alignas(64) atomic_uint tail;  // Next slot the producer fills
+} handoff_queue;
+
+static handoff_queue queues[MAX_THREADS / 2];
+
+/*
+ * Function: producer_thread
+ * -------------------------
+ * Body of the even threads of workload 12: allocates HANDOFF_BLOCKS blocks of 16 to
+ * 256 bytes, stamps each and pushes it onto its pair's queue, yielding while the
+ * queue is full.
+ */
+void *producer_thread(void *arg) {
+    handoff_queue *queue = &queues[(intptr_t)arg / 2];
+    uint32_t state = (uint32_t)(intptr_t)arg + 1;
+    for (unsigned int i = 0; i < HANDOFF_BLOCKS; i++) {
+        char *block = malloc(next_random(&state) % 241 + 16);
+        block[0] = (char)i;
+        unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == QUEUE_SLOTS) {
+            sched_yield();
+        }
+        queue->slots[tail % QUEUE_SLOTS] = block;
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/*
+ * Function: consumer_thread
+ * -------------------------
+ * Body of the odd threads of workload 12: takes HANDOFF_BLOCKS blocks off its pair's
+ * queue, yielding while it is empty, checks each one's stamp and frees it.
+ */
+void *consumer_thread(void *arg) {
+    handoff_queue *queue = &queues[(intptr_t)arg / 2];
+    for (unsigned int i = 0; i < HANDOFF_BLOCKS; i++) {
+        unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        while (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+            sched_yield();
+        }
+        char *block = queue->slots[head % QUEUE_SLOTS];
+        atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+        if (block[0] != (char)i) {
+            printf("Workload 12: block %u arrived corrupted\n", i);
+        }
+        free(block);
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 3: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    return NULL;
+}
+
+/*
+ * Function: handoff_thread
+ * ------------------------
+ * Body of workload 12: even threads produce and odd threads consume.
+ */
+void *handoff_thread(void *arg) {
+    return (intptr_t)arg % 2 == 0 ? producer_thread(arg) : consumer_thread(arg);
+}
 
-    // Measure time for workload 4
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload4();
+/*
+ * Function: workload12
+ * --------------------
+ * Workload 12 passes blocks from producer threads to consumer threads, which free them.
+ *
+ * Steps:
+ * 1. Pair the threads up, at least one pair even for a thread count of 1.
+ * 2. Start them, each running 'handoff_thread', and wait for them all.
+ *
+ * Purpose:
+ * - Every free is of a block another thread allocated, so this measures how cheaply
+ *   the allocator takes blocks back across threads.
+ */
+void workload12() {
+    int pairs = thread_count / 2 > 0 ? thread_count / 2 : 1;
+    for (int pair = 0; pair < pairs; pair++) {
+        atomic_store(&queues[pair].head, 0);
+        atomic_store(&queues[pair].tail, 0);
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 4: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    run_threads(pairs * 2, handoff_thread);
+}
+
+static void *larson_slots[MAX_THREADS][LARSON_SLOTS];
+static int larson_round;
 
-    // Measure time for workload 5
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload5();
+/*
+ * Function: larson_thread
+ * -----------------------
+ * Body of workload 13: takes over the slots the thread with the next lower index had
+ * in the previous round and replaces a random slot's block with a new one of 8 to
+ * 512 bytes LARSON_OPS times.
+ */
+void *larson_thread(void *arg) {
+    int index = ((int)(intptr_t)arg + larson_round) % thread_count;
+    void **slots = larson_slots[index];
+    uint32_t state = (uint32_t)index * 2654435761u + (uint32_t)larson_round + 1;
+    for (int i = 0; i < LARSON_OPS; i++) {
+        int slot = next_random(&state) % LARSON_SLOTS;
+        free(slots[slot]);
+        slots[slot] = malloc(next_random(&state) % 505 + 8);
+        *(char*)slots[slot] = (char)i;
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 5: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    return NULL;
+}
 
-    // Measure time for workload 6
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload6();
+/*
+ * Function: workload13
+ * --------------------
+ * Workload 13 simulates a server in the style of the Larson benchmark, where objects
+ * outlive the thread that allocated them.
+ *
+ * Steps:
+ * 1. Fill LARSON_SLOTS slots per thread with blocks of 8 to 512 bytes.
+ * 2. For LARSON_ROUNDS rounds, start a fresh set of threads, each running
+ *    'larson_thread' on the slots another thread used in the round before,
+ *    and wait for them.
+ * 3. Free every block left in the slots.
+ *
+ * Purpose:
+ * - Most frees are of blocks another thread allocated, and threads come and go while
+ *   their blocks live on, which stresses the handing back of blocks and caches.
+ */
+void workload13() {
+    for (int t = 0; t < thread_count; t++) {
+        for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+            larson_slots[t][slot] = malloc(rand() % 505 + 8);
+        }
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 6: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    for (larson_round = 0; larson_round < LARSON_ROUNDS; larson_round++) {
+        run_threads(thread_count, larson_thread);
+    }
+    for (int t = 0; t < thread_count; t++) {
+        for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+            free(larson_slots[t][slot]);
+        }
+    }
+}
 
-    // Measure time for workload 7
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload7();
+/*
+ * Function: counter_thread
+ * ------------------------
+ * Body of workload 14: allocates an 8-byte counter COUNTER_ROUNDS times and
+ * increments it COUNTER_INCREMENTS times through a volatile pointer, so every
+ * increment is a store to the counter's cache line.
+ */
+void *counter_thread(void *arg) {
+    (void)arg;
+    for (int round = 0; round < COUNTER_ROUNDS; round++) {
+        volatile long *counter = malloc(sizeof(long));
+        *counter = 0;
+        for (int i = 0; i < COUNTER_INCREMENTS; i++) {
+            (*counter)++;
+        }
+        free((void*)counter);
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 7: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    return NULL;
+}
+
+/*
+ * Function: workload14
+ * --------------------
+ * Workload 14 has every thread hammer a small counter it allocated itself.
+ *
+ * Steps:
+ * 1. Start the threads, each running 'counter_thread', and wait for them all.
+ *
+ * Purpose:
+ * - Counters that the allocator placed on the same cache line make the threads
+ *   steal the line from each other on every store (false sharing), which shows up
+ *   as a time that grows with the thread count instead of staying flat.
+ */
+void workload14() {
+    run_threads(thread_count, counter_thread);
+}
+
+/*
+ * Function: run_workload9
+ * -----------------------
+ * Workload 9 without a stats snapshot, in the form the workload table takes.
+ */
+void run_workload9() {
+    workload9(NULL);
+}
+
+static const workload workloads[] = {
+    { "workload1", workload1, RUNS, 240, false },
+    { "workload2", workload2, RUNS, 240, false },
+    { "workload3", workload3, RUNS, 240, false },
+    { "workload4", workload4, RUNS, 120, false },
+    { "workload5", workload5, RUNS, 100, false },
+    { "workload6", workload6, RUNS, 400, false },
+    { "workload7", workload7, RUNS, 2, false },
+    { "workload8", workload8, RUNS, 1, false },
+    { "workload9", run_workload9, RUNS, 4 * FRAG_BLOCKS, false },
+    { "workload10", workload10, SPREAD_RUNS, 2 * SPREAD_BLOCKS, false },
+    { "workload11", workload11, THREAD_RUNS, 2 * CHURN_OPS, true },
+    { "workload12", workload12, THREAD_RUNS, HANDOFF_BLOCKS, true },
+    { "workload13", workload13, THREAD_RUNS, 2 * (LARSON_SLOTS + LARSON_ROUNDS * LARSON_OPS), true },
+    { "workload14", workload14, THREAD_RUNS, 2 * COUNTER_ROUNDS, true },
+};
+#define WORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
 
-    // Measure time for workload 8
-    gettimeofday(&start, NULL);
-    for (int i = 0; i < RUNS; i++) {
-        workload8();
+/*
+ * Function: now_ns
+ * ----------------
+ * Returns the monotonic clock in nanoseconds. Unlike gettimeofday it never jumps
+ * when the system time is set, and it resolves single nanoseconds.
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Function: compare_samples
+ * -------------------------
+ * Orders two run times for qsort.
+ */
+int compare_samples(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+#ifndef REALMALLOC
+/*
+ * Function: layout_thread
+ * -----------------------
+ * Writes the heap's layout to stderr every 'layout_interval' microseconds while a
+ * workload is measured, until 'layout_stop' is set.
+ *
+ * Steps:
+ * 1. Sleep for the interval.
+ * 2. Write a line naming the workload and setting, the time since it started, the
+ *    run being timed and how long the last run took, so the layout can be matched
+ *    with the run times.
+ * 3. Write the layout itself with mymalloc_write_layout.
+ *
+ * Note:
+ * - Writing the layout holds the heap lock, so the runs it overlaps are slower.
+ */
+void *layout_thread(void *arg) {
+    const char *label = arg;
+    struct timespec interval = { layout_interval / 1000000, layout_interval % 1000000 * 1000L };
+    long long start = now_ns();
+    while (!atomic_load(&layout_stop)) {
+        nanosleep(&interval, NULL);
+        char line[256];
+        int run = atomic_load(&layout_run);
+        int length = snprintf(line, sizeof(line), "layout %s at %.3f ms, %s %d, last run %.3f us\n", label,
+                              (now_ns() - start) / 1e6, run ? "run" : "warm-up", run,
+                              atomic_load(&layout_last_ns) / 1e3);
+        if (write(STDERR_FILENO, line, length) < 0) {
+            break;
+        }
+        mymalloc_write_layout(STDERR_FILENO);
     }
-    gettimeofday(&end, NULL);
-    printf("Workload 8: %ld microseconds\n", ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / RUNS);
+    return NULL;
+}
+#endif
+
+/*
+ * Function: measure
+ * -----------------
+ * Times every run of a workload on its own and summarises the spread of the run times.
+ *
+ * Steps:
+ * 1. Run the workload 'warmups' times untimed, so the arenas are mapped and the
+ *    caches warm before the first timed run.
+ * 2. Run it 'repetitions' times (or the workload's own default), reading the
+ *    monotonic clock around each run and keeping every sample.
+ * 3. Sort the samples and take the minimum, median, 99th percentile (nearest rank)
+ *    and maximum, plus the mean and the allocator calls per second at the median,
+ *    counting the calls of every thread a threaded workload started.
+ * 4. With -l, run 'layout_thread' alongside all the runs, unless -L names another
+ *    workload, telling it which run is being timed and how long the last one took.
+ *
+ * Returns:
+ *   The summary, with no peak RSS or fragmentation figures filled in.
+ *
+ * Note:
+ * - The samples live in a static array rather than on the heap being measured.
+ *   Below 100 runs the 99th percentile is the maximum.
+ */
+result measure(const workload *w, const char *setting) {
+    static long long samples[MAX_REPETITIONS];
+    int runs = repetitions ? repetitions : w->runs;
+#ifndef REALMALLOC
+    static char label[128];
+    pthread_t layout;
+    snprintf(label, sizeof(label), "%s%s%s", w->name, *setting ? " " : "", setting);
+    atomic_store(&layout_run, 0);
+    atomic_store(&layout_last_ns, 0);
+    atomic_store(&layout_stop, false);
+    bool layouts = layout_interval && (!layout_workload || strcmp(w->name, layout_workload) == 0)
+                   && pthread_create(&layout, NULL, layout_thread, label) == 0;
+#endif
+    for (int i = 0; i < warmups; i++) {
+        w->run();
+    }
+    long long total = 0;
+    for (int i = 0; i < runs; i++) {
+        atomic_store(&layout_run, i + 1);
+        long long start = now_ns();
+        w->run();
+        samples[i] = now_ns() - start;
+        atomic_store(&layout_last_ns, samples[i]);
+        total += samples[i];
+    }
+#ifndef REALMALLOC
+    if (layouts) {
+        atomic_store(&layout_stop, true);
+        pthread_join(layout, NULL);
+    }
+#endif
+    qsort(samples, runs, sizeof(samples[0]), compare_samples);
+    long long median = samples[(runs - 1) / 2];
+    result r = { allocator, w->name, setting, runs, samples[0], median, samples[(99 * runs + 99) / 100 - 1],
+                 samples[runs - 1], total / runs, median ? w->ops * (w->threaded ? threads_started : 1) * 1e9 / median : 0, 0, -1, 0 };
+    return r;
+}
+
+/*
+ * Function: peak_rss_kb
+ * ---------------------
+ * Returns the most memory this process has had resident so far, in kilobytes.
+ */
+long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/*
+ * Function: measure_apart
+ * -----------------------
+ * Measures a workload in a forked child under 'setting', so that it starts from a fresh
+ * heap and its peak RSS is its own rather than that of every workload before it.
+ *
+ * Steps:
+ * 1. Open a pipe and fork.
+ * 2. In the child, 'measure' the workload, add its peak RSS, write the result
+ *    to the pipe and exit.
+ * 3. In the parent, read the result and wait for the child. Exit if the child
+ *    died before writing it.
+ *
+ * Returns:
+ *   The child's result. Its strings point at data the child inherited unchanged.
+ */
+result measure_apart(const workload *w, const char *setting) {
+    result r;
+    int fds[2];
+    fflush(stdout);
+    pid_t child = pipe(fds) == 0 ? fork() : -1;
+    if (child < 0) {
+        perror("memgrind");
+        exit(1);
+    }
+    if (child == 0) {
+        close(fds[0]);
+        r = measure(w, setting);
+        r.peak_rss_kb = peak_rss_kb();
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &r, sizeof(r));
+    close(fds[0]);
+    waitpid(child, NULL, 0);
+    if (got != sizeof(r)) {
+        fprintf(stderr, "memgrind: %s did not finish\n", w->name);
+        exit(1);
+    }
+    return r;
+}
+
+/*
+ * Function: print_header
+ * ----------------------
+ * Prints the column names for the chosen output format. JSON needs none, as every
+ * result is an object of its own.
+ */
+void print_header() {
+    if (format == FORMAT_TEXT) {
+        printf("Allocator: %s\n", allocator);
+        printf("%-12s %-10s %6s %10s %10s %10s %10s %8s %8s  (microseconds per run)\n",
+               "Workload", "Setting", "Runs", "min", "median", "p99", "max", "Mops/s", "RSS KiB");
+    } else if (format == FORMAT_CSV) {
+        printf("allocator,workload,setting,runs,min_ns,median_ns,p99_ns,max_ns,mean_ns,"
+               "ops_per_sec,peak_rss_kb,fragmentation,heap_bytes\n");
+    }
+}
+
+/*
+ * Function: print_result
+ * ----------------------
+ * Prints one result in the chosen output format: a table row in microseconds, a CSV
+ * row in nanoseconds, or a JSON object in nanoseconds on a line of its own (JSON Lines),
+ * so results from forked children and from separate runs can simply be appended.
+ * The fragmentation and heap size are only printed when they were measured.
+ */
+void print_result(const result *r) {
+    if (format == FORMAT_TEXT) {
+        printf("%-12s %-10s %6d %10.3f %10.3f %10.3f %10.3f %8.2f %8ld", r->workload, r->setting, r->runs,
+               r->min / 1000.0, r->median / 1000.0, r->p99 / 1000.0, r->max / 1000.0,
+               r->ops_per_sec / 1e6, r->peak_rss_kb);
+        if (r->fragmentation >= 0) {
+            printf("  fragmentation %.3f  heap %zu bytes", r->fragmentation, r->heap_bytes);
+        }
+        printf("\n");
+    } else if (format == FORMAT_CSV) {
+        printf("%s,%s,%s,%d,%lld,%lld,%lld,%lld,%lld,%.0f,%ld,", r->allocator, r->workload, r->setting, r->runs,
+               r->min, r->median, r->p99, r->max, r->mean, r->ops_per_sec, r->peak_rss_kb);
+        if (r->fragmentation >= 0) {
+            printf("%.4f,%zu", r->fragmentation, r->heap_bytes);
+        } else {
+            printf(",");
+        }
+        printf("\n");
+    } else {
+        printf("{\"allocator\":\"%s\",\"workload\":\"%s\",\"setting\":\"%s\",\"runs\":%d,\"min_ns\":%lld,"
+               "\"median_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld,\"mean_ns\":%lld,\"ops_per_sec\":%.0f,"
+               "\"peak_rss_kb\":%ld", r->allocator, r->workload, r->setting, r->runs,
+               r->min, r->median, r->p99, r->max, r->mean, r->ops_per_sec, r->peak_rss_kb);
+        if (r->fragmentation >= 0) {
+            printf(",\"fragmentation\":%.4f,\"heap_bytes\":%zu", r->fragmentation, r->heap_bytes);
+        }
+        printf("}\n");
+    }
+    fflush(stdout);
+}
+
+/*
+ * Function: print_section
+ * -----------------------
+ * Prints a heading above a group of results, in the text format only.
+ */
+void print_section(const char *title) {
+    if (format == FORMAT_TEXT) {
+        printf("%s\n", title);
+    }
+}
+
+#ifndef REALMALLOC
+/*
+ * Function: compare_policies
+ * --------------------------
+ * Runs workloads 5, 6 and 9 under each placement policy and reports their times and
+ * the fragmentation workload 9 leaves behind.
+ *
+ * Steps:
+ * 1. For each policy, fork a child so that every policy starts from the same heap.
+ * 2. In the child, select the policy with mymalloc_set_policy and 'measure' each
+ *    workload, then run workload 9 once more to take stats at its fullest.
+ * 3. Print the results, with the fragmentation ratio and mapped bytes at workload 9's
+ *    fullest added to workload 9's, and exit.
+ * 4. Wait for the child before starting the next, so the lines come out in order.
+ *
+ * Purpose:
+ * - Lets a deployment pick the policy that suits it, set with MYMALLOC_POLICY.
+ */
+void compare_policies() {
+    static const char *names[] = { "segregated", "first", "next", "best" };
+    static const int compared[] = { 4, 5, 8 };  // Indexes of workloads 5, 6 and 9 in 'workloads'
+    print_section("Placement policies (workloads 5, 6 and 9):");
+    for (int policy = MYMALLOC_POLICY_SEGREGATED; policy <= MYMALLOC_POLICY_BEST_FIT; policy++) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+            return;
+        }
+        if (child == 0) {
+            result results[3];
+            mymalloc_set_policy(policy);
+            for (int w = 0; w < 3; w++) {
+                results[w] = measure(&workloads[compared[w]], names[policy]);
+            }
+            mymalloc_stats stats;
+            workload9(&stats);
+            results[2].fragmentation = stats.fragmentation;
+            results[2].heap_bytes = stats.heap_bytes;
+            for (int w = 0; w < 3; w++) {
+                results[w].peak_rss_kb = peak_rss_kb();
+                print_result(&results[w]);
+            }
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+    }
+}
+
+/*
+ * Function: compare_pages
+ * -----------------------
+ * Runs workload 10 with the arenas on base pages, transparent huge pages and reserved
+ * huge pages, and with NUMA placement, and reports its times.
+ *
+ * Steps:
+ * 1. For each setting, fork a child so that every setting maps its arenas afresh.
+ * 2. In the child, select the pages with mymalloc_set_pages, and NUMA placement with
+ *    mymalloc_set_numa for the last setting, then 'measure' workload 10.
+ * 3. Print the result and exit, or say that NUMA is not supported here.
+ * 4. Wait for the child before starting the next, so the lines come out in order.
+ *
+ * Purpose:
+ * - Lets a deployment decide whether to set MYMALLOC_PAGES and MYMALLOC_NUMA. Reserved
+ *   huge pages fall back to transparent ones unless vm.nr_hugepages is raised.
+ */
+void compare_pages() {
+    static const char *names[] = { "default", "thp", "hugetlb", "thp+numa" };
+    static const int settings[] = { MYMALLOC_PAGES_DEFAULT, MYMALLOC_PAGES_THP, MYMALLOC_PAGES_HUGETLB,
+                                    MYMALLOC_PAGES_THP };
+    print_section("Arena pages (workload 10):");
+    for (int s = 0; s < 4; s++) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+            return;
+        }
+        if (child == 0) {
+            mymalloc_set_pages(settings[s]);
+            if (s == 3 && mymalloc_set_numa(1) != 0) {
+                fprintf(stderr, "memgrind: NUMA placement is not supported by this kernel\n");
+                _exit(0);
+            }
+            result r = measure(&workloads[9], names[s]);
+            r.peak_rss_kb = peak_rss_kb();
+            print_result(&r);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+    }
+}
+
+#endif
+
+/*
+ * Function: sweep_threads
+ * -----------------------
+ * Runs the threaded workloads with 1, 2, 4 and so on up to 'max_threads' threads and
+ * reports their throughput at each count.
+ *
+ * Steps:
+ * 1. For each thread count, doubling from 1 and ending at 'max_threads' whether or not
+ *    it is a power of two, set 'thread_count' and 'measure_apart' each threaded workload.
+ * 2. Print the results, then go back to THREADS threads.
+ *
+ * Purpose:
+ * - Shows where the allocator stops scaling: the throughput of workloads 11 to 13
+ *   should grow with the thread count up to the number of CPUs, and the time of
+ *   workload 14 should stay flat unless counters share cache lines.
+ */
+void sweep_threads() {
+    static char labels[16][16];
+    int sweeps = 0;
+    print_section("Thread scaling (workloads 11 to 14):");
+    for (int count = 1; sweeps < 16; count = count * 2 < max_threads ? count * 2 : max_threads) {
+        snprintf(labels[sweeps], sizeof(labels[sweeps]), "%d thread%s", count, count > 1 ? "s" : "");
+        thread_count = count;
+        for (int w = 0; w < WORKLOADS; w++) {
+            if (workloads[w].threaded) {
+                result r = measure_apart(&workloads[w], labels[sweeps]);
+                print_result(&r);
+            }
+        }
+        sweeps++;
+        if (count == max_threads) {
+            break;
+        }
+    }
+    thread_count = THREADS;
+}
+
+/*
+ * Function: compare_with
+ * ----------------------
+ * Runs another memgrind binary on the same workloads and prints its results next
+ * to these, for instance memgrind_libc, which times the C library's malloc or
+ * whatever allocator LD_PRELOAD puts in front of it.
+ *
+ * Steps:
+ * 1. Open a pipe and start 'program' with "-f csv" and the same -r and -w as this
+ *    run, with its output going into the pipe.
+ * 2. Read its CSV rows, splitting each into CSV_FIELDS fields, and keep those
+ *    that name one of 'ours' and no setting.
+ * 3. Print both allocators' median and 99th percentile times, throughput and peak
+ *    RSS side by side, and how many times faster this allocator's median is.
+ *
+ * Parameters:
+ *   program - The other memgrind binary; looked up on PATH if it has no slash.
+ *   ours    - This binary's results, one per entry of 'workloads'.
+ */
+void compare_with(const char *program, const result *ours) {
+    char runs_text[16], warmups_text[16], line[1024];
+    snprintf(runs_text, sizeof(runs_text), "%d", repetitions);
+    snprintf(warmups_text, sizeof(warmups_text), "%d", warmups);
+    char *args[] = { (char*)program, "-f", "csv", "-w", warmups_text, repetitions ? "-r" : NULL, runs_text, NULL };
+    int fds[2];
+    fflush(stdout);
+    pid_t child = pipe(fds) == 0 ? fork() : -1;
+    if (child < 0) {
+        perror("memgrind");
+        exit(1);
+    }
+    if (child == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(program, args);
+        perror(program);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    char theirs_name[64] = "";
+    long long median[WORKLOADS] = { 0 }, p99[WORKLOADS] = { 0 };
+    double ops[WORKLOADS] = { 0 };
+    long rss[WORKLOADS] = { 0 };
+    FILE *input = fdopen(fds[0], "r");
+    while (input && fgets(line, sizeof(line), input)) {
+        char *fields[CSV_FIELDS], *cursor = line;
+        int count = 0;
+        line[strcspn(line, "\n")] = '\0';
+        while (count < CSV_FIELDS) {
+            fields[count++] = cursor;
+            cursor = strchr(cursor, ',');
+            if (!cursor) {
+                break;
+            }
+            *cursor++ = '\0';
+        }
+        if (count != CSV_FIELDS || fields[2][0] != '\0') {
+            continue;  // The header, or a comparison's row
+        }
+        for (int w = 0; w < WORKLOADS; w++) {
+            if (strcmp(fields[1], workloads[w].name) == 0) {
+                snprintf(theirs_name, sizeof(theirs_name), "%s", fields[0]);
+                median[w] = atoll(fields[5]);
+                p99[w] = atoll(fields[6]);
+                ops[w] = atof(fields[9]);
+                rss[w] = atol(fields[10]);
+            }
+        }
+    }
+    if (input) {
+        fclose(input);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    if (!theirs_name[0]) {
+        fprintf(stderr, "memgrind: %s gave no results\n", program);
+        exit(1);
+    }
+
+    printf("%-12s  %-36s  %-36s\n", "", allocator, theirs_name);
+    printf("%-12s  %8s %8s %8s %8s  %8s %8s %8s %8s  %7s\n", "Workload", "median", "p99", "Mops/s", "RSS KiB",
+           "median", "p99", "Mops/s", "RSS KiB", "Speedup");
+    for (int w = 0; w < WORKLOADS; w++) {
+        if (!median[w]) {
+            continue;
+        }
+        printf("%-12s  %8.3f %8.3f %8.2f %8ld  %8.3f %8.3f %8.2f %8ld  %6.2fx\n", ours[w].workload,
+               ours[w].median / 1000.0, ours[w].p99 / 1000.0, ours[w].ops_per_sec / 1e6, ours[w].peak_rss_kb,
+               median[w] / 1000.0, p99[w] / 1000.0, ops[w] / 1e6, rss[w],
+               ours[w].median ? (double)median[w] / ours[w].median : 0);
+    }
+    printf("(times in microseconds per run; speedup is %s's median over %s's)\n", theirs_name, allocator);
+}
+
+/*
+ * Function: usage
+ * ---------------
+ * Explains the command line on stderr and exits with a failure status.
+ */
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-r runs] [-w warmups] [-f text|csv|json] [-t threads] [-c other-memgrind] [-l us [-L workload]]\n"
+            "  -r  timed runs of every workload (default: %d, %d for workloads 10 to 14; at most %d)\n"
+            "  -w  untimed warm-up runs before them (default: %d)\n"
+            "  -f  output format (default: text)\n"
+            "  -t  most threads in the scaling sweep (default: the number of CPUs; at most %d)\n"
+            "  -c  run another build, e.g. ./memgrind_libc, and print both side by side\n"
+            "  -l  write the heap's layout to stderr every us microseconds while each workload runs (mymalloc only)\n"
+            "  -L  only write layouts while this workload runs, e.g. workload6\n",
+            program, RUNS, SPREAD_RUNS, MAX_REPETITIONS, WARMUP_RUNS, MAX_THREADS);
+    exit(1);
+}
+
+/*
+ * Function: main
+ * --------------
+ * Times every workload and prints the spread of its run times.
+ *
+ * Steps:
+ * 1. Read the repetitions, warm-up runs, output format, the most threads to sweep to,
+ *    the build to compare with, and the interval between heap layouts and the workload
+ *    to take them of, from the command line. A build with -DREALMALLOC names itself after
+ *    the library in LD_PRELOAD, if there is one, and has no layouts.
+ * 2. Seed the random number generator using srand.
+ * 3. 'measure_apart' each workload in turn. With -c, hand the results to 'compare_with'
+ *    and stop there.
+ * 4. Otherwise print the header and the results, and sweep the thread counts with
+ *    'sweep_threads'. Then compare the placement policies with 'compare_policies', and
+ *    the pages arenas are backed by with 'compare_pages', which builds with
+ *    -DREALMALLOC do not have.
+ *
+ * Purpose:
+ * - Measures the performance of the allocator under different workloads.
+ * - Gives the minimum, median, 99th percentile and maximum of each, so a change in the
+ *   median can be told apart from noise, and CSV or JSON output to track it over time.
+ */
+int main(int argc, char **argv) {
+    const char *other = NULL;
+    int option;
+    max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        max_threads = max_threads < 1 ? 1 : MAX_THREADS;
+    }
+    while ((option = getopt(argc, argv, "r:w:f:t:c:l:L:")) != -1) {
+        if (option == 'r') {
+            repetitions = atoi(optarg);
+            if (repetitions < 1 || repetitions > MAX_REPETITIONS) {
+                usage(argv[0]);
+            }
+        } else if (option == 'w') {
+            warmups = atoi(optarg);
+            if (warmups < 0) {
+                usage(argv[0]);
+            }
+        } else if (option == 'f' && strcmp(optarg, "text") == 0) {
+            format = FORMAT_TEXT;
+        } else if (option == 'f' && strcmp(optarg, "csv") == 0) {
+            format = FORMAT_CSV;
+        } else if (option == 'f' && strcmp(optarg, "json") == 0) {
+            format = FORMAT_JSON;
+        } else if (option == 't') {
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > MAX_THREADS) {
+                usage(argv[0]);
+            }
+        } else if (option == 'c') {
+            other = optarg;
+#ifndef REALMALLOC
+        } else if (option == 'l') {
+            layout_interval = atoi(optarg);
+            if (layout_interval < 1) {
+                usage(argv[0]);
+            }
+        } else if (option == 'L') {
+            layout_workload = optarg;
+#endif
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+#ifdef REALMALLOC
+    const char *preload = getenv("LD_PRELOAD");
+    if (preload && *preload) {
+        allocator = strrchr(preload, '/') ? strrchr(preload, '/') + 1 : preload;
+    }
+#endif
+
+    srand((unsigned int)time(NULL)); // Seed the random number generator
+
+    result results[WORKLOADS];
+    for (int w = 0; w < WORKLOADS; w++) {
+        results[w] = measure_apart(&workloads[w], "");
+        if (!other) {
+            if (w == 0) {
+                print_header();
+            }
+            print_result(&results[w]);
+        }
+    }
+    if (other) {
+        compare_with(other, results);
+        return 0;
+    }
+
+    sweep_threads();
+#ifndef REALMALLOC
+    compare_policies();
+    compare_pages();
+#endif
 
     return 0; // Return success
 }
@@ -0,0 +1,333 @@
+// memreplay.c
+/*Replays a trace recorded with MYMALLOC_TRACE (or mymalloc_trace_start)
+against mymalloc, or against the C library's malloc when compiled with
+-DREALMALLOC, and reports how long it took and how fragmented the heap
+ended up. The trace file is mapped rather than read, so traces of
+millions of calls load at once and never touch the heap being measured*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+// Compile with -DREALMALLOC to replay against the C library's malloc (or a preloaded one) instead of mymalloc()
+#ifdef REALMALLOC
+#define MYMALLOC_NO_MACROS  // Only the trace format is wanted
+#define ALLOCATOR "libc"
+#else
+#define ALLOCATOR "mymalloc"
+#endif
+#include "mymalloc.h"
+
+#define RUNS 5  // Number of times the trace is replayed unless -r says otherwise
+#define MAX_RUNS 1000
+
+/*
+ * A trace as the replay sees it: its events, straight from the mapped file, and
+ * what the checking pass learned about them. 'blocks' holds the block each id
+ * names during a run and 'sizes' its size; both are mapped rather than allocated.
+ */
+typedef struct trace {
+    const mymalloc_trace_event *events;
+    size_t count;
+    uint32_t max_id;
+    int threads;
+    size_t peak_live;   // Most bytes the recorded program asked for that were live at once
+    void **blocks;
+    size_t *sizes;
+} trace;
+
+/*
+ * Function: now_ns
+ * ----------------
+ * Returns the monotonic clock in nanoseconds.
+ */
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Function: compare_samples
+ * -------------------------
+ * Orders two run times for qsort.
+ */
+int compare_samples(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: map_zeroed
+ * --------------------
+ * Maps 'bytes' of zeroed memory outside the allocator being measured, or exits.
+ */
+void *map_zeroed(size_t bytes) {
+    void *memory = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("memreplay");
+        exit(1);
+    }
+    return memory;
+}
+
+/*
+ * Function: load_trace
+ * --------------------
+ * Maps a trace file and checks that it can be replayed.
+ *
+ * Steps:
+ * 1. Map the whole file read-only and tell the kernel it will be read in order, so it
+ *    reads ahead instead of faulting in one page at a time.
+ * 2. Check the header's magic, version and event size, and that the file holds whole events.
+ * 3. Find the highest id and the number of threads, and map the arrays indexed by id.
+ *    Ids are handed out from 1 upwards, so no event can name an id above its own
+ *    position in the trace; an id past that is rejected before it sizes the arrays.
+ * 4. Go through the events once more as the replay will, checking that every free names
+ *    a live block and every allocation other than a realloc a free id, and note the peak
+ *    of the live bytes asked for.
+ *
+ * Parameters:
+ *   path - The trace file.
+ *   t    - Filled in with the trace.
+ *
+ * Returns:
+ *   false, with an error message, if the file cannot be read or is not a valid trace.
+ */
+bool load_trace(const char *path, trace *t) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        perror(path);
+        return false;
+    }
+    if ((size_t)info.st_size < sizeof(mymalloc_trace_header)) {
+        fprintf(stderr, "%s: Not a trace file\n", path);
+        close(fd);
+        return false;
+    }
+    const char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    madvise((void*)data, info.st_size, MADV_SEQUENTIAL);
+
+    const mymalloc_trace_header *header = (const mymalloc_trace_header*)data;
+    size_t bytes = info.st_size - sizeof(*header);
+    if (memcmp(header->magic, MYMALLOC_TRACE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != MYMALLOC_TRACE_VERSION || header->event_size != sizeof(mymalloc_trace_event)
+        || bytes % sizeof(mymalloc_trace_event) != 0) {
+        fprintf(stderr, "%s: Not a version %d trace file\n", path, MYMALLOC_TRACE_VERSION);
+        munmap((void*)data, info.st_size);
+        return false;
+    }
+    t->events = (const mymalloc_trace_event*)(header + 1);
+    t->count = bytes / sizeof(mymalloc_trace_event);
+    t->max_id = 0;
+    t->threads = 0;
+    for (size_t i = 0; i < t->count; i++) {
+        if (t->events[i].id > i + 1) {
+            fprintf(stderr, "%s: Event %zu does not follow from the ones before it\n", path, i);
+            munmap((void*)data, info.st_size);
+            return false;
+        }
+        if (t->events[i].id > t->max_id) {
+            t->max_id = t->events[i].id;
+        }
+        if (t->events[i].thread > t->threads) {
+            t->threads = t->events[i].thread;
+        }
+    }
+    size_t ids = (size_t)t->max_id + 1;
+    t->blocks = map_zeroed(ids * sizeof(void*));
+    t->sizes = map_zeroed(ids * sizeof(size_t));
+
+    size_t live = 0;
+    t->peak_live = 0;
+    bool *in_use = map_zeroed(ids);
+    for (size_t i = 0; i < t->count; i++) {
+        const mymalloc_trace_event *e = &t->events[i];
+        bool resizing = e->op == MYMALLOC_TRACE_REALLOC;  // Of a NULL or untraced block if the id is free
+        if (e->id == 0 || e->op > MYMALLOC_TRACE_MEMALIGN
+            || (!resizing && in_use[e->id] != (e->op == MYMALLOC_TRACE_FREE))
+            || (e->op != MYMALLOC_TRACE_FREE && e->size == 0)) {
+            fprintf(stderr, "%s: Event %zu does not follow from the ones before it\n", path, i);
+            munmap(in_use, ids);
+            munmap(t->blocks, ids * sizeof(void*));
+            munmap(t->sizes, ids * sizeof(size_t));
+            munmap((void*)data, info.st_size);
+            return false;
+        }
+        live += e->size - t->sizes[e->id];
+        t->sizes[e->id] = e->size;
+        in_use[e->id] = e->op != MYMALLOC_TRACE_FREE;
+        if (live > t->peak_live) {
+            t->peak_live = live;
+        }
+    }
+    munmap(in_use, ids);
+    return true;
+}
+
+/*
+ * Function: replay
+ * ----------------
+ * Makes every call of the trace once, in the order it was recorded, and writes to the
+ * first byte of every block so that each one is really backed by memory. Calls that
+ * were made by different threads are all made by this one.
+ *
+ * Returns:
+ *   The number of calls that failed.
+ */
+size_t replay(const trace *t) {
+    size_t failed = 0;
+    for (size_t i = 0; i < t->count; i++) {
+        const mymalloc_trace_event *e = &t->events[i];
+        void *block = NULL;
+        if (e->op == MYMALLOC_TRACE_MALLOC) {
+            block = malloc(e->size);
+        } else if (e->op == MYMALLOC_TRACE_FREE) {
+            free(t->blocks[e->id]);
+            t->blocks[e->id] = NULL;
+            continue;
+        } else if (e->op == MYMALLOC_TRACE_REALLOC) {
+            block = t->blocks[e->id] ? realloc(t->blocks[e->id], e->size) : malloc(e->size);
+            if (!block) {
+                free(t->blocks[e->id]);
+            }
+        } else if (e->op == MYMALLOC_TRACE_CALLOC) {
+            block = calloc(1, e->size);
+        } else if (e->align_shift < 3) {  // posix_memalign wants at least pointer alignment
+            block = malloc(e->size);
+        } else if (posix_memalign(&block, (size_t)1 << e->align_shift, e->size) != 0) {
+            block = NULL;
+        }
+        if (block) {
+            *(volatile char*)block = 1;
+        } else {
+            failed++;
+        }
+        t->blocks[e->id] = block;
+    }
+    return failed;
+}
+
+/*
+ * Function: release_all
+ * ---------------------
+ * Frees the blocks the trace left live, so the next run starts from the same heap.
+ */
+void release_all(const trace *t) {
+    for (uint32_t id = 1; id <= t->max_id; id++) {
+        free(t->blocks[id]);
+        t->blocks[id] = NULL;
+    }
+}
+
+/*
+ * Function: usage
+ * ---------------
+ * Explains the command line on stderr and exits with a failure status.
+ */
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-r runs] trace-file\n"
+            "  -r  times the trace is replayed (default: %d; at most %d)\n"
+            "Record a trace with MYMALLOC_TRACE=trace-file LD_PRELOAD=./libmymalloc.so program\n",
+            program, RUNS, MAX_RUNS);
+    exit(1);
+}
+
+/*
+ * Function: main
+ * --------------
+ * Replays a trace several times and reports the time it took and the state of the heap.
+ *
+ * Steps:
+ * 1. Read the number of runs and the trace file from the command line, and load the
+ *    trace with 'load_trace'. A build with -DREALMALLOC names itself after the library
+ *    in LD_PRELOAD, if there is one.
+ * 2. Replay it 'runs' times, reading the monotonic clock around each replay but not
+ *    around the frees of the blocks it left live, which come after.
+ * 3. After the first run, which starts from a fresh heap like the recorded program did,
+ *    take mymalloc's stats before freeing the leftovers: the fragmentation the
+ *    trace leaves behind and the most memory the heap mapped for it.
+ * 4. Print the minimum and median run time, the time per call and calls per second at
+ *    the median, and the peak RSS next to the peak of live bytes the trace asked for.
+ *
+ * Note:
+ * - The recorded timestamps and threads are reported but not reproduced: the calls are
+ *   made back to back by one thread, so the replay measures the allocator's own work
+ *   and the heap it leaves, not lock contention between threads.
+ */
+int main(int argc, char **argv) {
+    static long long samples[MAX_RUNS];
+    int runs = RUNS;
+    int option;
+    while ((option = getopt(argc, argv, "r:")) != -1) {
+        if (option == 'r') {
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    trace t;
+    if (!load_trace(argv[optind], &t)) {
+        return 1;
+    }
+    const char *allocator = ALLOCATOR;
+#ifdef REALMALLOC
+    const char *preload = getenv("LD_PRELOAD");
+    if (preload && *preload) {
+        allocator = strrchr(preload, '/') ? strrchr(preload, '/') + 1 : preload;
+    }
+#else
+    mymalloc_stats stats;
+#endif
+
+    size_t failed = 0;
+    for (int i = 0; i < runs; i++) {
+        long long start = now_ns();
+        failed += replay(&t);
+        samples[i] = now_ns() - start;
+#ifndef REALMALLOC
+        if (i == 0) {
+            mymalloc_get_stats(&stats);
+        }
+#endif
+        release_all(&t);
+    }
+    qsort(samples, runs, sizeof(samples[0]), compare_samples);
+    long long median = samples[(runs - 1) / 2];
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("Trace: %s (%zu calls from %d threads, at most %zu bytes live)\n",
+           argv[optind], t.count, t.threads, t.peak_live);
+    printf("Allocator: %s\n", allocator);
+    printf("%6s %12s %12s %10s %8s %10s  (microseconds per replay)\n",
+           "Runs", "min", "median", "ns/call", "Mops/s", "RSS KiB");
+    printf("%6d %12.1f %12.1f %10.1f %8.2f %10ld\n", runs, samples[0] / 1e3, median / 1e3,
+           t.count ? (double)median / t.count : 0, median ? t.count * 1e3 / median : 0, usage.ru_maxrss);
+#ifndef REALMALLOC
+    printf("Heap after the first replay: %.3f fragmentation, %zu bytes mapped (%zu at the peak)\n",
+           stats.fragmentation, stats.heap_bytes, stats.peak_heap_bytes);
+#endif
+    if (failed) {
+        printf("%zu calls failed\n", failed);
+    }
+    return 0;
+}
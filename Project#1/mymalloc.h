@@ -1,9 +1,129 @@
 #ifndef _MYMALLOC_H
 #define _MYMALLOC_H
+#include <stddef.h>
+#include <stdint.h>
 
+#ifndef MYMALLOC_NO_MACROS
 #define malloc(x) mymalloc(x, __FILE__, __LINE__)
 #define free(x) myfree(x, __FILE__, __LINE__)
+#define realloc(ptr, x) myrealloc(ptr, x, __FILE__, __LINE__)
+#define calloc(n, x) mycalloc(n, x, __FILE__, __LINE__)
+#define memalign(alignment, x) mymemalign(alignment, x, __FILE__, __LINE__)
+#define aligned_alloc(alignment, x) myaligned_alloc(alignment, x, __FILE__, __LINE__)
+#define posix_memalign(out, alignment, x) myposix_memalign(out, alignment, x, __FILE__, __LINE__)
+#define slab_create(size) myslab_create(size, __FILE__, __LINE__)
+#define slab_alloc(cache) myslab_alloc(cache, __FILE__, __LINE__)
+#define slab_free(cache, x) myslab_free(cache, x, __FILE__, __LINE__)
+#define slab_destroy(cache) myslab_destroy(cache, __FILE__, __LINE__)
+#define region_create(block_size) myregion_create(block_size, __FILE__, __LINE__)
+#define region_alloc(region, size, alignment) myregion_alloc(region, size, alignment, __FILE__, __LINE__)
+#define region_destroy(region) myregion_destroy(region, __FILE__, __LINE__)
+#endif
 
 void *mymalloc(size_t size, char *file, int line);
 void myfree(void *ptr, char *file, int line);
+void *myrealloc(void *ptr, size_t size, char *file, int line);
+void *mycalloc(size_t count, size_t size, char *file, int line);
+void *mymemalign(size_t alignment, size_t size, char *file, int line);
+void *myaligned_alloc(size_t alignment, size_t size, char *file, int line);
+int myposix_memalign(void **out, size_t alignment, size_t size, char *file, int line);
+void mymalloc_init(size_t arena_size);
+void mymalloc_set_mmap_threshold(size_t size);
+size_t mymalloc_usable_size(void *ptr);
+
+// Where free chunks are taken from; see mymalloc_set_policy
+#define MYMALLOC_POLICY_SEGREGATED 0  // Size-class bins (the default)
+#define MYMALLOC_POLICY_FIRST_FIT 1   // Lowest-addressed chunk that fits
+#define MYMALLOC_POLICY_NEXT_FIT 2    // First chunk that fits after the last one taken
+#define MYMALLOC_POLICY_BEST_FIT 3    // Smallest chunk that fits
+void mymalloc_set_policy(int policy);
+
+// What new arenas are backed by; see mymalloc_set_pages
+#define MYMALLOC_PAGES_DEFAULT 0  // Base pages
+#define MYMALLOC_PAGES_THP 1      // Transparent huge pages (madvise MADV_HUGEPAGE)
+#define MYMALLOC_PAGES_HUGETLB 2  // Reserved huge pages (MAP_HUGETLB), else transparent ones
+void mymalloc_set_pages(int pages);
+int mymalloc_set_numa(int enabled);
+
+// Size class i counts blocks of up to 16 << i bytes
+#define MYMALLOC_STAT_CLASSES 50
+typedef struct mymalloc_stats {
+    size_t bytes_in_use;     // Payload of live blocks, mapped blocks included
+    size_t bytes_free;       // Free chunks in the arenas
+    size_t bytes_cached;     // Chunks parked in thread caches
+    size_t largest_free;     // Largest free chunk in the arenas
+    double fragmentation;    // Share of free bytes outside the largest free chunk
+    size_t heap_bytes;       // Mapped for arenas and large blocks
+    size_t peak_heap_bytes;  // Highest 'heap_bytes' so far
+    size_t allocs[MYMALLOC_STAT_CLASSES];
+    size_t frees[MYMALLOC_STAT_CLASSES];
+} mymalloc_stats;
+void mymalloc_get_stats(mymalloc_stats *stats);
+void mymalloc_write_stats(int fd);
+
+// What a chunk visited by mymalloc_heap_walk holds
+#define MYMALLOC_CHUNK_USED 0
+#define MYMALLOC_CHUNK_FREE 1
+#define MYMALLOC_CHUNK_CACHED 2  // Freed into a thread cache or quick list, not merged yet
+#define MYMALLOC_CHUNK_MAPPED 3  // In use, with a mapping of its own
+typedef struct mymalloc_chunk_info {
+    size_t arena;   // Arenas are numbered newest first, then each mapped chunk gets a number
+    size_t offset;  // Of the chunk's header from the start of its arena or mapping
+    size_t size;    // Payload bytes, not counting the 8-byte header
+    int state;      // MYMALLOC_CHUNK_*
+} mymalloc_chunk_info;
+void mymalloc_heap_walk(void (*visit)(const mymalloc_chunk_info *chunk, void *arg), void *arg);
+void mymalloc_write_layout(int fd);
+
+#define MYMALLOC_PROFILE_TABLE 0   // Bytes, objects and live totals per call site
+#define MYMALLOC_PROFILE_FOLDED 1  // "file:line bytes" lines for flame graph tools
+void mymalloc_profile_rate(size_t bytes);
+void mymalloc_write_profile(int fd, int format);
+
+typedef struct mymalloc_snapshot mymalloc_snapshot;
+mymalloc_snapshot *mymalloc_snapshot_take(void);
+void mymalloc_snapshot_diff(const mymalloc_snapshot *before, const mymalloc_snapshot *after, int fd);
+void mymalloc_snapshot_release(mymalloc_snapshot *snapshot);
+
+// A trace file is this header followed by one event per call; see mymalloc_trace_start
+#define MYMALLOC_TRACE_MAGIC "MYMTRACE"
+#define MYMALLOC_TRACE_VERSION 1
+#define MYMALLOC_TRACE_MALLOC 0
+#define MYMALLOC_TRACE_FREE 1
+#define MYMALLOC_TRACE_REALLOC 2
+#define MYMALLOC_TRACE_CALLOC 3    // 'size' is the whole array
+#define MYMALLOC_TRACE_MEMALIGN 4
+typedef struct mymalloc_trace_header {
+    char magic[8];        // MYMALLOC_TRACE_MAGIC, without its terminator
+    uint32_t version;
+    uint32_t event_size;  // sizeof(mymalloc_trace_event)
+} mymalloc_trace_header;
+typedef struct mymalloc_trace_event {
+    uint64_t time;        // Nanoseconds since the trace started
+    uint64_t size;        // Bytes asked for; 0 for a free
+    uint32_t id;          // Names the block until it is freed, after which the id is reused
+    uint16_t thread;      // Threads are numbered from 1 in the order they first appear
+    uint8_t op;           // MYMALLOC_TRACE_*
+    uint8_t align_shift;  // log2 of a memalign's alignment
+} mymalloc_trace_event;
+int mymalloc_trace_start(const char *path);
+void mymalloc_trace_stop(void);
+
+typedef struct myslab_cache myslab_cache;
+myslab_cache *myslab_create(size_t object_size, char *file, int line);
+void *myslab_alloc(myslab_cache *cache, char *file, int line);
+void myslab_free(myslab_cache *cache, void *ptr, char *file, int line);
+void myslab_destroy(myslab_cache *cache, char *file, int line);
+
+typedef struct myregion myregion;
+typedef struct myregion_mark {
+    struct region_block *block;
+    size_t used;
+} myregion_mark;
+myregion *myregion_create(size_t block_size, char *file, int line);
+void *myregion_alloc(myregion *region, size_t size, size_t alignment, char *file, int line);
+myregion_mark myregion_save(myregion *region);
+void myregion_rewind(myregion *region, myregion_mark mark);
+void myregion_reset(myregion *region);
+void myregion_destroy(myregion *region, char *file, int line);
 #endif
@@ -0,0 +1,93 @@
+// mymalloc_preload.c
+/*Exports the standard allocation functions on top of mymalloc, so that
+libmymalloc.so can replace the system allocator for a whole program:
+    LD_PRELOAD=./libmymalloc.so ./program
+Every call from libc, strdup, getline or third-party code then lands in
+mymalloc without recompiling anything*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#define MYMALLOC_NO_MACROS  // This file defines the real names
+#include "mymalloc.h"
+
+// Reported as the call site in error messages, which cannot name the real caller
+#define PRELOAD_SITE "libmymalloc", 0
+
+/*
+ * Function: malloc
+ * ----------------
+ * Unlike mymalloc, returns a unique block rather than NULL for a zero size, since
+ * many programs treat a NULL from malloc(0) as running out of memory. Sets errno
+ * to ENOMEM on failure, as callers of the system malloc expect.
+ */
+void *malloc(size_t size) {
+    void *ptr = mymalloc(size ? size : 1, PRELOAD_SITE);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    myfree(ptr, PRELOAD_SITE);
+}
+
+/*
+ * Function: realloc
+ * -----------------
+ * A zero size frees the block and returns NULL, as glibc does.
+ */
+void *realloc(void *ptr, size_t size) {
+    void *resized = myrealloc(ptr, ptr || size ? size : 1, PRELOAD_SITE);
+    if (!resized && size) {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = count && size ? mycalloc(count, size, PRELOAD_SITE) : mycalloc(1, 1, PRELOAD_SITE);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    return myposix_memalign(out, alignment, size ? size : 1, PRELOAD_SITE);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = mymemalign(alignment, size ? size : 1, PRELOAD_SITE);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+/*
+ * Function: pvalloc
+ * -----------------
+ * Like valloc, with the size rounded up to whole pages.
+ */
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mymalloc_usable_size(ptr);
+}
@@ -5,9 +5,22 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdalign.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <time.h>      // Include this header for time()
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include "mymalloc.h"
 
+// Room a 1-byte block takes: the preload build aligns every block to alignof(max_align_t)
+#ifdef MYMALLOC_PRELOAD
+#define TINY_STRIDE 16
+#else
+#define TINY_STRIDE 8
+#endif
+
 /*
  * Function: test_basic_allocation
  * --------------------------------
@@ -105,6 +118,87 @@ void test_free_coalescing() {
     printf("    Freed second block, coalescing should occur\n");
 }
 
+/*
+ * Function: test_size_class_reuse
+ * -------------------------------
+ * Tests that a freed block is handed straight back for the next request of the same size.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate two 24-byte blocks 'a' and 'b' so 'a' cannot coalesce with the free space after 'b'.
+ * 3. Free 'a', which puts it on the 24-byte free list.
+ * 4. Allocate another 24-byte block 'c' and check that it reuses the address of 'a'.
+ * 5. Free the remaining blocks.
+ *
+ * Purpose:
+ * - Verifies that small requests are served from their size-class bin instead of
+ *   carving new space out of the heap.
+ */
+void test_size_class_reuse() {
+    printf("Test Size-Class Reuse:\n");
+    void *a = malloc(24);
+    void *b = malloc(24);
+    free(a);
+    void *c = malloc(24);
+    if (c == a) {
+        printf("    Freed block was reused for the same size\n");
+    } else {
+        printf("    Freed block was not reused (got %p, expected %p)\n", c, a);
+    }
+    free(b);
+    free(c);
+}
+
+/*
+ * Function: test_quick_lists
+ * --------------------------
+ * Tests that freed chunks wait on the quick lists instead of being merged at once.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate three adjacent 1000-byte blocks 'a', 'b' and 'c', too big for the thread caches.
+ * 3. Free 'a' and 'b' and check with mymalloc_stats that they are counted as cached
+ *    (still unmerged) rather than free.
+ * 4. Allocate two more 1000-byte blocks, which should get 'b' and then 'a' back.
+ * 5. Free 100 blocks of 1000 bytes, more than the lists keep, and check that they
+ *    were merged in a batch rather than all left cached.
+ *
+ * Purpose:
+ * - Verifies that a free followed by an allocation of the same size skips merging and splitting.
+ * - Ensures that the quick lists are consolidated once they pass their watermark.
+ */
+void test_quick_lists() {
+    printf("Test Quick Lists:\n");
+    mymalloc_stats before, after;
+    void *a = malloc(1000);
+    void *b = malloc(1000);
+    void *c = malloc(1000);
+    mymalloc_get_stats(&before);
+    free(a);
+    free(b);
+    mymalloc_get_stats(&after);
+    printf("    Two freed blocks %s\n", after.bytes_cached >= before.bytes_cached + 2000
+           ? "wait unmerged on the quick lists" : "were merged at once");
+    void *again1 = malloc(1000);
+    void *again2 = malloc(1000);
+    printf("    The next two requests %s\n", again1 == b && again2 == a ? "got them back" : "did not get them back");
+
+    void *ptrs[100];
+    for (int i = 0; i < 100; i++) {
+        ptrs[i] = malloc(1000);
+    }
+    mymalloc_get_stats(&before);
+    for (int i = 0; i < 100; i++) {
+        free(ptrs[i]);
+    }
+    mymalloc_get_stats(&after);
+    printf("    Freeing 100 blocks left %s of them cached\n",
+           after.bytes_cached < before.bytes_cached + 100000 ? "only some" : "all");
+    free(again1);
+    free(again2);
+    free(c);
+}
+
 /*
  * Function: test_double_free
  * --------------------------
@@ -209,6 +303,9 @@ void test_free_null_pointer() {
  * Note:
  * - Attempting to free an invalid pointer may cause undefined behavior or crash the program.
  * - The free(p) line is commented out to prevent accidental execution.
+ * - The checked build (mymalloc_debug_tests) rejects such pointers, so there the test
+ *   frees the stack variable and a pointer into the middle of a block, expecting an
+ *   error message for each, and runs from 'main'.
  *
  * Purpose:
  * - Tests the allocator's ability to detect and handle invalid free operations.
@@ -219,10 +316,45 @@ void test_free_invalid_pointer() {
     int x;
     int *p = &x;  // Stack variable
     (void)p;      // Suppress unused variable warning
+#ifdef MYMALLOC_DEBUG
+    free(p);
+    char *block = malloc(64);
+    free(block + 16);  // Interior pointer
+    free(block);
+    printf("    Attempted to free a stack variable and an interior pointer\n");
+#else
     // Uncomment the next line to test invalid free (will cause undefined behavior)
     // free(p);
     // printf("    Attempted to free an invalid pointer\n");
+#endif
+}
+
+#ifdef MYMALLOC_DEBUG
+/*
+ * Function: test_guard_checks
+ * ---------------------------
+ * Tests the redzones and free poisoning of the checked build.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate 20 bytes, write one byte past the end and free the block, which should
+ *    report a buffer overflow.
+ * 3. Allocate 64 bytes, free them and look at a byte the free path does not reuse,
+ *    which should hold the poison pattern 0xDF.
+ *
+ * Note:
+ * - Reading freed memory is exactly the bug poisoning exposes; it is done here on purpose.
+ */
+void test_guard_checks() {
+    printf("Test Guard Checks:\n");
+    char *block = malloc(20);
+    block[20] = 'x';
+    free(block);
+    unsigned char *freed = malloc(64);
+    free(freed);
+    printf("    Freed memory reads 0x%02X\n", freed[40]);
 }
+#endif
 
 /*
  * Function: test_alignment
@@ -294,6 +426,1091 @@ void test_large_allocation() {
     }
 }
 
+/*
+ * Function: test_mapped_allocation
+ * --------------------------------
+ * Tests blocks big enough to get a mapping of their own.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate a 1MB block and fill it with a pattern.
+ * 3. Grow it to 16MB with myrealloc and check the pattern survived.
+ * 4. Shrink it back below the mmap threshold, check the first bytes again and free it.
+ *
+ * Purpose:
+ * - Verifies that large blocks can be resized without losing their contents,
+ *   both within a mapping and when moving back into the arenas.
+ */
+void test_mapped_allocation() {
+    printf("Test Mapped Allocation:\n");
+    size_t size = 1 << 20;
+    unsigned char *p = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        p[i] = (unsigned char)(i * 7);
+    }
+    p = realloc(p, 16 << 20);
+    int errors = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != (unsigned char)(i * 7)) {
+            errors++;
+        }
+    }
+    p[(16 << 20) - 1] = 1;
+    p = realloc(p, 1000);
+    for (size_t i = 0; i < 1000; i++) {
+        if (p[i] != (unsigned char)(i * 7)) {
+            errors++;
+        }
+    }
+    printf("    Grew a 1MB block to 16MB and shrank it to 1000 bytes with %d incorrect bytes\n", errors);
+    free(p);
+}
+
+/*
+ * Function: test_realloc_in_place
+ * -------------------------------
+ * Tests that realloc resizes arena blocks without moving them when it can.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate a 1000-byte block and fill it with a pattern.
+ * 3. Shrink it to 100 bytes, which must keep the same address and free the tail.
+ * 4. Grow it back to 1000 bytes, which can take the tail freed in step 3.
+ * 5. Check the first 100 bytes kept the pattern and free the block.
+ *
+ * Purpose:
+ * - Verifies that shrinking splits in place and growing absorbs a free neighbour.
+ */
+void test_realloc_in_place() {
+    printf("Test Realloc In Place:\n");
+    unsigned char *p = malloc(1000);
+    memset(p, 0x5a, 1000);
+    unsigned char *shrunk = realloc(p, 100);
+    unsigned char *grown = realloc(shrunk, 1000);
+    int errors = 0;
+    for (int i = 0; i < 100; i++) {
+        if (grown[i] != 0x5a) {
+            errors++;
+        }
+    }
+    printf("    Shrink %s, grow %s, %d incorrect bytes\n", shrunk == p ? "stayed in place" : "moved",
+           grown == p ? "stayed in place" : "moved", errors);
+    free(grown);
+}
+
+/*
+ * Function: test_calloc
+ * ---------------------
+ * Tests that calloc returns zeroed memory.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Dirty a 512-byte block and free it, then calloc 64 elements of 8 bytes, which
+ *    may reuse it, and a 1MB array, which gets its own mapping.
+ * 3. Count the non-zero bytes in both and free them.
+ * 4. Check that a count * size overflow returns NULL.
+ *
+ * Purpose:
+ * - Verifies that reused memory is zeroed and that large arrays are zero as mapped.
+ */
+void test_calloc() {
+    printf("Test Calloc:\n");
+    unsigned char *dirty = malloc(512);
+    memset(dirty, 0xff, 512);
+    free(dirty);
+    unsigned char *small = calloc(64, 8);
+    unsigned char *large = calloc(1 << 20, 1);
+    int nonzero = 0;
+    for (int i = 0; i < 512; i++) {
+        nonzero += small[i] != 0;
+    }
+    for (int i = 0; i < 1 << 20; i++) {
+        nonzero += large[i] != 0;
+    }
+    printf("    %d non-zero bytes\n", nonzero);
+    free(small);
+    free(large);
+    if (calloc(SIZE_MAX / 2, 4) == NULL) {
+        printf("    Overflowing calloc returned NULL\n");
+    }
+}
+
+/*
+ * Function: test_aligned_allocation
+ * ---------------------------------
+ * Tests the aligned allocation entry points.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. For every alignment from 16 to 4096 bytes, allocate a few blocks with memalign,
+ *    aligned_alloc and posix_memalign, check their addresses and fill them.
+ * 3. Allocate a 1MB block aligned to 64KB, which gets its own mapping, and check it.
+ * 4. Free everything with free, and check posix_memalign rejects an alignment of 24.
+ *
+ * Purpose:
+ * - Verifies that aligned blocks honour their alignment and are freed like any other block.
+ */
+void test_aligned_allocation() {
+    printf("Test Aligned Allocation:\n");
+    void *blocks[30];
+    int count = 0;
+    int misaligned = 0;
+    for (size_t alignment = 16; alignment <= 4096; alignment *= 2) {
+        void *p = memalign(alignment, 100);
+        void *q = aligned_alloc(alignment, alignment * 2);
+        void *r = NULL;
+        posix_memalign(&r, alignment, 40);
+        blocks[count++] = p;
+        blocks[count++] = q;
+        blocks[count++] = r;
+        misaligned += (uintptr_t)p % alignment != 0;
+        misaligned += (uintptr_t)q % alignment != 0;
+        misaligned += (uintptr_t)r % alignment != 0;
+        memset(p, 1, 100);
+        memset(q, 2, alignment * 2);
+        memset(r, 3, 40);
+    }
+    void *big = memalign(1 << 16, 1 << 20);
+    misaligned += (uintptr_t)big % (1 << 16) != 0;
+    memset(big, 4, 1 << 20);
+    printf("    %d of %d aligned blocks misaligned\n", misaligned, count + 1);
+    for (int i = 0; i < count; i++) {
+        free(blocks[i]);
+    }
+    free(big);
+    void *bad;
+    if (posix_memalign(&bad, 24, 100) == EINVAL) {
+        printf("    posix_memalign rejected an alignment of 24\n");
+    }
+}
+
+/*
+ * Function: test_usable_size
+ * --------------------------
+ * Tests that mymalloc_usable_size reports at least the requested size.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate blocks of 1, 13, 300 and 200000 bytes and compare each usable size with the request.
+ * 3. Free the blocks.
+ *
+ * Purpose:
+ * - Verifies the size malloc_usable_size reports in the preloaded library.
+ */
+void test_usable_size() {
+    printf("Test Usable Size:\n");
+    size_t sizes[] = {1, 13, 300, 200000};
+    int short_blocks = 0;
+    for (int i = 0; i < 4; i++) {
+        void *p = malloc(sizes[i]);
+        if (mymalloc_usable_size(p) < sizes[i]) {
+            short_blocks++;
+        }
+        free(p);
+    }
+    printf("    %d blocks smaller than requested\n", short_blocks);
+}
+
+#ifdef MYMALLOC_PRELOAD
+/*
+ * Function: test_preload_alignment
+ * --------------------------------
+ * Tests that the exported malloc, calloc and realloc return blocks aligned to
+ * alignof(max_align_t), which the system allocator guarantees on x86-64.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. For every size from 1 to 4096, call malloc and calloc for it and realloc a block of
+ *    it to three times the size, which moves the block, and check every address against
+ *    ((uintptr_t)p & 15). The names are parenthesized to get past the header's macros.
+ * 3. Free the blocks.
+ *
+ * Purpose:
+ * - Verifies that libmymalloc.so can stand in for the system malloc under programs
+ *   that keep SSE values or long doubles in their blocks.
+ */
+void test_preload_alignment() {
+    printf("Test Preload Alignment:\n");
+    int misaligned = 0;
+    for (size_t size = 1; size <= 4096; size++) {
+        void *p = (malloc)(size);
+        void *q = (calloc)(1, size);
+        void *r = (realloc)((malloc)(size), size * 3);
+        misaligned += ((uintptr_t)p & 15) != 0;
+        misaligned += ((uintptr_t)q & 15) != 0;
+        misaligned += ((uintptr_t)r & 15) != 0;
+        (free)(p);
+        (free)(q);
+        (free)(r);
+    }
+    printf("    %d of %d blocks not aligned to 16 bytes\n", misaligned, 3 * 4096);
+}
+#endif
+
+/*
+ * Function: test_tiny_blocks
+ * --------------------------
+ * Tests the header-free blocks that serve requests of up to 64 bytes.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate 1000 blocks of 1 byte and count how many sit exactly TINY_STRIDE bytes
+ *    after the one before, and how many report a usable size other than TINY_STRIDE.
+ * 3. Fill every block with its index and check it, then grow one block to TINY_STRIDE bytes,
+ *    which should keep it in place, and to 100 bytes, which should keep its contents.
+ * 4. Free the blocks.
+ *
+ * Purpose:
+ * - Verifies that tiny blocks are packed at their size with no header between them.
+ * - Ensures that they can be resized and freed like any other block.
+ */
+void test_tiny_blocks() {
+    printf("Test Tiny Blocks:\n");
+    unsigned char *ptrs[1000];
+    int packed = 0;
+    int wrong_size = 0;
+    int errors = 0;
+    for (int i = 0; i < 1000; i++) {
+        ptrs[i] = malloc(1);
+        if (i > 0 && ptrs[i] == ptrs[i - 1] + TINY_STRIDE) {
+            packed++;
+        }
+        if (mymalloc_usable_size(ptrs[i]) != TINY_STRIDE) {
+            wrong_size++;
+        }
+        *ptrs[i] = (unsigned char)i;
+    }
+    for (int i = 0; i < 1000; i++) {
+        if (*ptrs[i] != (unsigned char)i) {
+            errors++;
+        }
+    }
+    printf("    %d of 999 blocks %d bytes after the previous one, %d with a usable size other than %d\n",
+           packed, TINY_STRIDE, wrong_size, TINY_STRIDE);
+
+    unsigned char *grown = realloc(ptrs[0], TINY_STRIDE);
+    printf("    Growing to %d bytes %s the block\n", TINY_STRIDE, grown == ptrs[0] ? "kept" : "moved");
+    ptrs[0] = realloc(grown, 100);
+    if (!ptrs[0] || *ptrs[0] != 0) {
+        errors++;
+    }
+    printf("    %d incorrect blocks\n", errors);
+    for (int i = 0; i < 1000; i++) {
+        free(ptrs[i]);
+    }
+}
+
+/*
+ * Function: test_arena_growth
+ * ---------------------------
+ * Tests that the heap grows past a single arena instead of running out of memory.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate 256 blocks of 1 KiB each, several arenas' worth at the default arena size.
+ * 3. Fill each block with its own index, then check every block still holds it.
+ * 4. Print how many blocks were allocated and whether their contents survived.
+ * 5. Free all blocks, which releases the arenas that become empty.
+ *
+ * Purpose:
+ * - Verifies that new arenas are added when the current ones are exhausted.
+ * - Ensures blocks in different arenas do not overlap.
+ */
+void test_arena_growth() {
+    printf("Test Arena Growth:\n");
+    unsigned char *ptrs[256];
+    int allocated = 0;
+    int errors = 0;
+    for (; allocated < 256 && (ptrs[allocated] = malloc(1024)); allocated++) {
+        memset(ptrs[allocated], allocated, 1024);
+    }
+    for (int i = 0; i < allocated; i++) {
+        for (int j = 0; j < 1024; j++) {
+            if (ptrs[i][j] != (unsigned char)i) {
+                errors++;
+            }
+        }
+    }
+    printf("    Allocated %d blocks of 1 KiB with %d incorrect bytes\n", allocated, errors);
+    for (int i = 0; i < allocated; i++) {
+        free(ptrs[i]);
+    }
+}
+
+/*
+ * Function: test_placement_policies
+ * ---------------------------------
+ * Tests each placement policy on blocks too big for the thread caches.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. For each policy, select it with mymalloc_set_policy, allocate 200 blocks of random
+ *    sizes and fill each with its index, free every other block and refill the holes
+ *    with blocks of other sizes, then check every block and free them all.
+ * 3. Under best fit, free a 2000-byte and a 600-byte block (each followed by a block
+ *    that keeps them apart) and allocate 600 bytes, which should not split the big hole.
+ * 4. Ask for an unknown policy, which should be reported, and go back to the default.
+ *
+ * Purpose:
+ * - Verifies that every policy hands out non-overlapping blocks from the same bins.
+ */
+void test_placement_policies() {
+    printf("Test Placement Policies:\n");
+    static const char *names[] = { "segregated", "first", "next", "best" };
+    unsigned char *ptrs[200];
+    size_t sizes[200];
+    for (int policy = MYMALLOC_POLICY_SEGREGATED; policy <= MYMALLOC_POLICY_BEST_FIT; policy++) {
+        mymalloc_set_policy(policy);
+        int errors = 0;
+        for (int i = 0; i < 200; i++) {
+            sizes[i] = rand() % 3000 + 300;
+            ptrs[i] = malloc(sizes[i]);
+            memset(ptrs[i], i, sizes[i]);
+        }
+        for (int i = 1; i < 200; i += 2) {
+            free(ptrs[i]);
+            sizes[i] = rand() % 3000 + 300;
+            ptrs[i] = malloc(sizes[i]);
+            memset(ptrs[i], i, sizes[i]);
+        }
+        for (int i = 0; i < 200; i++) {
+            for (size_t j = 0; j < sizes[i]; j++) {
+                if (ptrs[i][j] != (unsigned char)i) {
+                    errors++;
+                }
+            }
+            free(ptrs[i]);
+        }
+        printf("    %s: %d incorrect bytes\n", names[policy], errors);
+    }
+
+    void *big = malloc(2000), *fence1 = malloc(300), *small = malloc(600), *fence2 = malloc(300);
+    free(big);
+    free(small);
+    void *fit = malloc(600);
+    printf("    Best fit left the bigger hole alone: %s\n", fit != big ? "yes" : "no");
+    free(fit);
+    free(fence1);
+    free(fence2);
+    mymalloc_set_policy(42);
+    mymalloc_set_policy(MYMALLOC_POLICY_SEGREGATED);
+}
+
+/*
+ * Function: test_best_fit_tree
+ * ----------------------------
+ * Tests that best fit finds the smallest hole among many in one range bin.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate 500 pairs of blocks of 7000 to 10992 bytes in steps of 8 and free the first
+ *    block of each pair in shuffled order; the second keeps the holes from merging,
+ *    unless it had to go into a new arena.
+ * 3. Under best fit, ask for exactly the size of every 25th hole that is fenced in this
+ *    way on both sides and check that the block returned is that hole, or lies below it
+ *    (a leftover chunk of the same size at a lower address wins the tie).
+ * 4. Free everything and go back to the default policy.
+ *
+ * Purpose:
+ * - Verifies that the size-ordered tree of a range bin stays in order through
+ *   inserts and removals, and that its lookup returns the best fit.
+ */
+void test_best_fit_tree() {
+    printf("Test Best Fit Tree:\n");
+    static void *holes[500], *fences[500], *order[500];
+    for (int i = 0; i < 500; i++) {
+        holes[i] = malloc(7000 + 8 * i);
+        fences[i] = malloc(7000 + 8 * i);  // Growing sizes never fit an earlier leftover, so it follows the hole
+        order[i] = holes[i];
+    }
+    for (int i = 0; i < 500; i++) {
+        int j = rand() % 500;
+        void *temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+    for (int i = 0; i < 500; i++) {
+        free(order[i]);
+    }
+    mymalloc_set_policy(MYMALLOC_POLICY_BEST_FIT);
+    int exact = 0, fenced = 0;
+    for (int i = 25; i < 500; i += 25) {
+        size_t gap = (char*)fences[i] - (char*)holes[i];
+        size_t before = (char*)holes[i] - (char*)fences[i - 1];
+        int walled = gap >= (size_t)(7000 + 8 * i) && gap < (size_t)(7000 + 8 * i + 64)
+                     && before >= (size_t)(7000 + 8 * (i - 1)) && before < (size_t)(7000 + 8 * (i - 1) + 64);
+        void *fit = malloc(7000 + 8 * i);
+        fenced += walled;
+        exact += walled && (char*)fit <= (char*)holes[i];  // Ties go to the lowest address
+        holes[i] = fit;
+    }
+    printf("    %d of %d requests got their hole, or an equal chunk below it\n", exact, fenced);
+    for (int i = 0; i < 500; i++) {
+        if (i % 25 == 0 && i > 0) {
+            free(holes[i]);
+        }
+        free(fences[i]);
+    }
+    mymalloc_set_policy(MYMALLOC_POLICY_SEGREGATED);
+}
+
+/*
+ * Function: anon_huge_kb
+ * ----------------------
+ * Returns the kilobytes of this process's memory the kernel currently backs with
+ * transparent huge pages, read from /proc/self/smaps_rollup, or 0 if it cannot be read.
+ */
+static long anon_huge_kb() {
+    char line[256];
+    long kb = 0;
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+/*
+ * Function: test_arena_pages
+ * --------------------------
+ * Tests arenas backed by transparent huge pages and bound to the allocating thread's node.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Switch to transparent huge pages and NUMA placement, allocate 4000 blocks of
+ *    1000 bytes, write to all of them and check their contents.
+ * 3. Report whether the kernel backed them with huge pages, which it may decline to do
+ *    (THP turned off, or no huge page free).
+ * 4. Ask the kernel with get_mempolicy which node the first block's page is on, and
+ *    check that it is the node this thread is running on.
+ * 5. Free everything and go back to base pages with no NUMA placement.
+ *
+ * Purpose:
+ * - Verifies that arenas mapped with huge page alignment and an mbind policy hold
+ *   ordinary, usable blocks, and that the options take effect where the kernel allows.
+ */
+void test_arena_pages() {
+    printf("Test Arena Pages:\n");
+    static char *blocks[4000];
+    mymalloc_set_pages(MYMALLOC_PAGES_THP);
+    int numa = mymalloc_set_numa(1) == 0;
+    int intact = 1;
+    for (int i = 0; i < 4000; i++) {
+        blocks[i] = malloc(1000);
+        memset(blocks[i], i & 0xff, 1000);
+    }
+    for (int i = 0; i < 4000; i++) {
+        intact &= blocks[i][0] == (char)(i & 0xff) && blocks[i][999] == (char)(i & 0xff);
+    }
+    printf("    4000 blocks on huge page arenas are %s\n", intact ? "intact" : "corrupted");
+    printf("    The kernel %s\n", anon_huge_kb() > 0 ? "backed them with huge pages"
+           : "kept them on base pages (THP off or no huge page free)");
+    if (numa) {
+        int page_node = -1;
+        unsigned int cpu_node = 0;
+        syscall(SYS_get_mempolicy, &page_node, NULL, 0, blocks[0], MPOL_F_NODE | MPOL_F_ADDR);
+        syscall(SYS_getcpu, NULL, &cpu_node, NULL);
+        printf("    The first block is on %s node\n", page_node == (int)cpu_node ? "this thread's" : "another");
+    } else {
+        printf("    NUMA placement is not supported by this kernel\n");
+    }
+    for (int i = 0; i < 4000; i++) {
+        free(blocks[i]);
+    }
+    mymalloc_set_numa(0);
+    mymalloc_set_pages(MYMALLOC_PAGES_DEFAULT);
+}
+
+/*
+ * Function: test_trace
+ * --------------------
+ * Tests recording a trace of allocator calls for memreplay.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Start a trace in /tmp, then malloc, realloc, calloc, free, malloc again, memalign
+ *    and free everything, and stop the trace.
+ * 3. Read the file back and check its header, then check each event's call, id, size
+ *    and alignment against what was done: the block freed first hands its id to the
+ *    next malloc, and the free of a NULL pointer is not recorded.
+ * 4. Record a second trace in which a new thread allocates 10 bytes and then this thread
+ *    20, and check that the threads are numbered from 1 in the order they first appear
+ *    and that the two get different numbers, although this thread was numbered in the
+ *    first trace. pthread_create may allocate too, which the preload build records.
+ * 5. Remove the file.
+ *
+ * Purpose:
+ * - Verifies that a trace names every block consistently from its allocation to its
+ *   free, so it can be replayed exactly.
+ * - Ensures that every trace numbers its threads afresh.
+ */
+void *trace_other_thread(void *arg) {
+    (void)arg;
+    free(malloc(10));
+    return NULL;
+}
+
+void test_trace() {
+    printf("Test Trace:\n");
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mymalloc_test_%d.trace", (int)getpid());
+    if (mymalloc_trace_start(path) != 0) {
+        printf("    Unable to record a trace to %s\n", path);
+        return;
+    }
+    char *a = malloc(100);
+    a = realloc(a, 5000);
+    char *b = calloc(4, 10);
+    free(a);
+    char *c = malloc(7);
+    char *d = memalign(64, 200);
+    free(NULL);
+    free(b);
+    free(c);
+    free(d);
+    mymalloc_trace_stop();
+
+    static const mymalloc_trace_event expected[] = {
+        { 0, 100, 1, 1, MYMALLOC_TRACE_MALLOC, 0 },
+        { 0, 5000, 1, 1, MYMALLOC_TRACE_REALLOC, 0 },
+        { 0, 40, 2, 1, MYMALLOC_TRACE_CALLOC, 0 },
+        { 0, 0, 1, 1, MYMALLOC_TRACE_FREE, 0 },
+        { 0, 7, 1, 1, MYMALLOC_TRACE_MALLOC, 0 },
+        { 0, 200, 3, 1, MYMALLOC_TRACE_MEMALIGN, 6 },
+        { 0, 0, 2, 1, MYMALLOC_TRACE_FREE, 0 },
+        { 0, 0, 1, 1, MYMALLOC_TRACE_FREE, 0 },
+        { 0, 0, 3, 1, MYMALLOC_TRACE_FREE, 0 },
+    };
+    mymalloc_trace_header header;
+    mymalloc_trace_event events[10];
+    FILE *file = fopen(path, "rb");
+    size_t count = 0;
+    int valid = file && fread(&header, sizeof(header), 1, file) == 1
+                && memcmp(header.magic, MYMALLOC_TRACE_MAGIC, sizeof(header.magic)) == 0
+                && header.event_size == sizeof(mymalloc_trace_event);
+    if (valid) {
+        count = fread(events, sizeof(events[0]), 10, file);
+    }
+    int matches = valid && count == 9;
+    for (size_t i = 0; matches && i < count; i++) {
+        matches = events[i].op == expected[i].op && events[i].id == expected[i].id
+                  && events[i].thread == expected[i].thread
+                  && events[i].size == expected[i].size && events[i].align_shift == expected[i].align_shift
+                  && (i == 0 || events[i].time >= events[i - 1].time);
+    }
+    printf("    The trace file %s\n", valid ? "has a valid header" : "is missing or invalid");
+    printf("    It holds %zu events, which %s the calls made\n", count, matches ? "match" : "do not match");
+    if (file) {
+        fclose(file);
+    }
+
+    pthread_t thread;
+    if (mymalloc_trace_start(path) != 0 || pthread_create(&thread, NULL, trace_other_thread, NULL) != 0) {
+        printf("    Unable to record a second trace to %s\n", path);
+        unlink(path);
+        return;
+    }
+    pthread_join(thread, NULL);
+    free(malloc(20));
+    mymalloc_trace_stop();
+    file = fopen(path, "rb");
+    count = 0;
+    if (file && fread(&header, sizeof(header), 1, file) == 1) {
+        count = fread(events, sizeof(events[0]), 10, file);
+    }
+    int renumbered = count > 0;
+    int threads = 0, other = 0, self = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].thread == threads + 1) {
+            threads++;
+        } else if (events[i].thread < 1 || events[i].thread > threads) {
+            renumbered = 0;
+        }
+        if (events[i].op == MYMALLOC_TRACE_MALLOC) {
+            other = events[i].size == 10 ? events[i].thread : other;
+            self = events[i].size == 20 ? events[i].thread : self;
+        }
+    }
+    renumbered = renumbered && other && self && other != self;
+    printf("    A second trace %s its threads from 1\n", renumbered ? "numbers" : "does not number");
+    if (file) {
+        fclose(file);
+    }
+    unlink(path);
+}
+
+/*
+ * Function: check_layout_chunk
+ * ----------------------------
+ * Visits one chunk for test_heap_layout, checking that it starts where the previous
+ * chunk of its arena ended and adding up the free ones.
+ */
+typedef struct layout_check {
+    size_t arena;
+    size_t next_offset;
+    size_t chunks;
+    size_t gaps;
+    size_t bytes_free;
+    size_t largest_free;
+    size_t mapped;
+} layout_check;
+
+void check_layout_chunk(const mymalloc_chunk_info *chunk, void *arg) {
+    layout_check *check = arg;
+    if (chunk->state == MYMALLOC_CHUNK_MAPPED) {
+        check->mapped++;
+        return;
+    }
+    if (check->chunks && chunk->arena == check->arena && chunk->offset != check->next_offset) {
+        check->gaps++;
+    }
+    check->arena = chunk->arena;
+    check->next_offset = chunk->offset + 8 + chunk->size;
+    check->chunks++;
+    if (chunk->state == MYMALLOC_CHUNK_FREE) {
+        check->bytes_free += chunk->size;
+        check->largest_free = chunk->size > check->largest_free ? chunk->size : check->largest_free;
+    }
+}
+
+/*
+ * Function: test_heap_layout
+ * --------------------------
+ * Tests walking the heap and writing its layout.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Allocate 40 blocks of 5000 bytes, too big for the thread caches and quick lists,
+ *    free every other one, and allocate a block big enough for a mapping of its own.
+ * 3. Walk the heap with mymalloc_heap_walk and check that every chunk starts right
+ *    after the one before it in its arena, that the free bytes and largest free chunk
+ *    agree with mymalloc_get_stats, and that the mapped block was visited.
+ * 4. Write the layout to a file with mymalloc_write_layout, read it back and check
+ *    that its histogram counts at least 20 free chunks in the classes from 8192 bytes
+ *    up. A hole may have merged with free space next to it, but never with another.
+ * 5. Free the remaining blocks.
+ *
+ * Purpose:
+ * - Verifies that the walk covers the heap exactly, and that the layout reports the
+ *   holes a workload leaves.
+ */
+void test_heap_layout() {
+    printf("Test Heap Layout:\n");
+    char *blocks[40];
+    for (int i = 0; i < 40; i++) {
+        blocks[i] = malloc(5000);
+    }
+    for (int i = 0; i < 40; i += 2) {
+        free(blocks[i]);
+    }
+    char *big = malloc(1 << 20);
+
+    layout_check check = { 0 };
+    mymalloc_stats stats;
+    mymalloc_heap_walk(check_layout_chunk, &check);
+    mymalloc_get_stats(&stats);
+    printf("    Walked %zu chunks with %zu gaps between them\n", check.chunks, check.gaps);
+    printf("    Free bytes and largest free chunk %s the stats\n",
+           check.bytes_free == stats.bytes_free && check.largest_free == stats.largest_free ? "match" : "do not match");
+    printf("    The mapped block was %s\n", check.mapped ? "visited" : "missed");
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mymalloc_test_%d.layout", (int)getpid());
+    FILE *file = fopen(path, "w+");
+    char line[1024] = "";
+    size_t holes = 0;
+    if (file) {
+        mymalloc_write_layout(fileno(file));
+        rewind(file);
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "free sizes:", 11) == 0) {
+                size_t size, count;
+                int used;
+                for (char *entry = line + 11; sscanf(entry, " %zu:%zu%n", &size, &count, &used) == 2; entry += used) {
+                    holes += size >= 8192 ? count : 0;
+                }
+                break;
+            }
+        }
+        fclose(file);
+        unlink(path);
+    }
+    printf("    The layout's histogram %s the 20 holes\n", holes >= 20 ? "counts" : "misses");
+    for (int i = 1; i < 40; i += 2) {
+        free(blocks[i]);
+    }
+    free(big);
+}
+
+/*
+ * Function: threaded_worker
+ * -------------------------
+ * Body of each thread started by test_threaded_allocation.
+ *
+ * Steps:
+ * 1. Repeatedly pick a random slot of the thread's 'thread_work' record.
+ * 2. If the slot is empty, allocate 1 to 300 bytes and fill them with a byte derived from the slot and thread.
+ * 3. If the slot is in use, count any byte that no longer matches, then free the block.
+ * 4. Leave the blocks still in use in the record for the main thread to free.
+ */
+typedef struct thread_work {
+    unsigned char *ptrs[64];
+    size_t sizes[64];
+    unsigned int seed;
+    int id;
+    int errors;
+} thread_work;
+
+void *threaded_worker(void *arg) {
+    thread_work *work = arg;
+    for (int i = 0; i < 20000; i++) {
+        int slot = rand_r(&work->seed) % 64;
+        unsigned char fill = (unsigned char)(slot * 4 + work->id);
+        if (!work->ptrs[slot]) {
+            work->sizes[slot] = rand_r(&work->seed) % 300 + 1;
+            work->ptrs[slot] = malloc(work->sizes[slot]);
+            memset(work->ptrs[slot], fill, work->sizes[slot]);
+        } else {
+            for (size_t j = 0; j < work->sizes[slot]; j++) {
+                if (work->ptrs[slot][j] != fill) {
+                    work->errors++;
+                    break;
+                }
+            }
+            free(work->ptrs[slot]);
+            work->ptrs[slot] = NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: test_threaded_allocation
+ * ----------------------------------
+ * Tests the allocator when several threads allocate and free at the same time.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Start four threads running 'threaded_worker', each with its own seed.
+ * 3. Wait for all threads to finish.
+ * 4. Free the blocks each thread left behind from the main thread, so they are
+ *    released by a different thread than the one that allocated them.
+ * 5. Print the number of corrupted blocks the threads found.
+ *
+ * Purpose:
+ * - Verifies that concurrent allocations never hand out overlapping blocks.
+ * - Checks that blocks may be freed by a thread other than the one that allocated them.
+ */
+void test_threaded_allocation() {
+    printf("Test Threaded Allocation:\n");
+    pthread_t threads[4];
+    thread_work work[4];
+    memset(work, 0, sizeof(work));
+    for (int t = 0; t < 4; t++) {
+        work[t].seed = (unsigned int)rand();
+        work[t].id = t;
+        pthread_create(&threads[t], NULL, threaded_worker, &work[t]);
+    }
+    int errors = 0;
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        errors += work[t].errors;
+        for (int slot = 0; slot < 64; slot++) {
+            free(work[t].ptrs[slot]);
+        }
+    }
+    printf("    4 threads finished with %d corrupted blocks\n", errors);
+}
+
+/*
+ * Function: remote_free_producer
+ * ------------------------------
+ * Producer thread for test_remote_free.
+ *
+ * Steps:
+ * 1. Allocate 100 blocks of 48 bytes and publish them in the shared 'remote_handoff' record.
+ * 2. Wait until the main thread reports that it has freed them all.
+ * 3. Allocate 100 more blocks of the same size and count how many land on a published address.
+ * 4. Free the new blocks.
+ */
+typedef struct remote_handoff {
+    void *ptrs[100];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int stage;  // 1 once the blocks are published, 2 once they are freed
+    int reused;
+} remote_handoff;
+
+void *remote_free_producer(void *arg) {
+    remote_handoff *handoff = arg;
+    for (int i = 0; i < 100; i++) {
+        handoff->ptrs[i] = malloc(48);
+    }
+    pthread_mutex_lock(&handoff->lock);
+    handoff->stage = 1;
+    pthread_cond_signal(&handoff->changed);
+    while (handoff->stage != 2) {
+        pthread_cond_wait(&handoff->changed, &handoff->lock);
+    }
+    pthread_mutex_unlock(&handoff->lock);
+
+    void *again[100];
+    for (int i = 0; i < 100; i++) {
+        again[i] = malloc(48);
+        for (int j = 0; j < 100; j++) {
+            if (again[i] == handoff->ptrs[j]) {
+                handoff->reused++;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < 100; i++) {
+        free(again[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Function: test_remote_free
+ * --------------------------
+ * Tests that blocks freed by a different thread go back to the thread that allocated them.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Start 'remote_free_producer' and wait for it to publish its 100 blocks.
+ * 3. Free all of them from the main thread, then tell the producer to continue.
+ * 4. Wait for the producer and print how many of its new blocks reused a remotely freed address.
+ *
+ * Purpose:
+ * - Verifies the producer/consumer path: remote frees are queued for the owning thread
+ *   and picked up on its next allocations.
+ */
+void test_remote_free() {
+    printf("Test Remote Free:\n");
+    remote_handoff handoff = { .stage = 0, .reused = 0 };
+    pthread_mutex_init(&handoff.lock, NULL);
+    pthread_cond_init(&handoff.changed, NULL);
+    pthread_t producer;
+    pthread_create(&producer, NULL, remote_free_producer, &handoff);
+
+    pthread_mutex_lock(&handoff.lock);
+    while (handoff.stage != 1) {
+        pthread_cond_wait(&handoff.changed, &handoff.lock);
+    }
+    for (int i = 0; i < 100; i++) {
+        free(handoff.ptrs[i]);
+    }
+    handoff.stage = 2;
+    pthread_cond_signal(&handoff.changed);
+    pthread_mutex_unlock(&handoff.lock);
+
+    pthread_join(producer, NULL);
+    printf("    %d of 100 blocks freed by another thread were reused by their owner\n", handoff.reused);
+    pthread_mutex_destroy(&handoff.lock);
+    pthread_cond_destroy(&handoff.changed);
+}
+
+/*
+ * Function: test_slab_cache
+ * -------------------------
+ * Tests the fixed-size slab allocator.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Create a slab cache for 40-byte objects.
+ * 3. Allocate 5000 objects (several slabs' worth) and fill each with its index.
+ * 4. Free every other object, allocate 2500 again, and check the objects that were
+ *    never freed still hold their index.
+ * 5. Free everything and destroy the cache.
+ *
+ * Purpose:
+ * - Verifies that slab objects do not overlap and that freed slots are reused.
+ */
+void test_slab_cache() {
+    printf("Test Slab Cache:\n");
+    myslab_cache *cache = slab_create(40);
+    static unsigned char *objs[5000];
+    int errors = 0;
+    for (int i = 0; i < 5000; i++) {
+        objs[i] = slab_alloc(cache);
+        memset(objs[i], (unsigned char)i, 40);
+    }
+    for (int i = 0; i < 5000; i += 2) {
+        slab_free(cache, objs[i]);
+    }
+    for (int i = 0; i < 5000; i += 2) {
+        objs[i] = slab_alloc(cache);
+        memset(objs[i], (unsigned char)i, 40);
+    }
+    for (int i = 1; i < 5000; i += 2) {
+        for (int j = 0; j < 40; j++) {
+            if (objs[i][j] != (unsigned char)i) {
+                errors++;
+            }
+        }
+    }
+    printf("    Allocated 5000 40-byte objects with %d incorrect bytes\n", errors);
+    for (int i = 0; i < 5000; i++) {
+        slab_free(cache, objs[i]);
+    }
+    slab_destroy(cache);
+}
+
+/*
+ * Function: test_region
+ * ---------------------
+ * Tests the region (bump) allocator.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Create a region with 1KB blocks and allocate 200 objects of mixed sizes and
+ *    alignments, spilling over several blocks.
+ * 3. Check each object's alignment, save a mark, allocate past it and rewind.
+ * 4. Allocate again and check the new object lands where the rewound one did.
+ * 5. Reset the region, allocate once more, and destroy it.
+ *
+ * Purpose:
+ * - Verifies that region objects honour their alignment and that rewind and reset
+ *   hand the released space back to the region.
+ */
+void test_region() {
+    printf("Test Region:\n");
+    myregion *region = region_create(1024);
+    int misaligned = 0;
+    for (int i = 0; i < 200; i++) {
+        size_t alignment = (size_t)1 << (i % 7);
+        char *p = region_alloc(region, 1 + i % 50, alignment);
+        if ((uintptr_t)p % alignment) {
+            misaligned++;
+        }
+        memset(p, i, 1 + i % 50);
+    }
+    myregion_mark mark = myregion_save(region);
+    char *first = region_alloc(region, 64, 16);
+    for (int i = 0; i < 50; i++) {
+        region_alloc(region, 100, 8);
+    }
+    myregion_rewind(region, mark);
+    char *again = region_alloc(region, 64, 16);
+    printf("    %d misaligned objects, rewind %s space\n", misaligned, first == again ? "reused" : "did not reuse");
+    myregion_reset(region);
+    region_alloc(region, 32, 0);
+    region_destroy(region);
+}
+
+/*
+ * Function: test_stats
+ * --------------------
+ * Tests the statistics API.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Take a snapshot, allocate 100 blocks of 64 bytes and one of 1MB, and take another.
+ * 3. Check that bytes in use grew by at least the requested bytes and that the size
+ *    classes together counted 101 more allocations.
+ * 4. Free the blocks, check they counted 101 more frees, and print the stats as JSON.
+ *
+ * Purpose:
+ * - Verifies that the merged per-thread counters and the heap walk track live memory.
+ */
+void test_stats() {
+    printf("Test Stats:\n");
+    mymalloc_stats before, during, after;
+    void *blocks[100];
+    mymalloc_get_stats(&before);
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = malloc(64);
+    }
+    void *big = malloc(1 << 20);
+    mymalloc_get_stats(&during);
+    for (int i = 0; i < 100; i++) {
+        free(blocks[i]);
+    }
+    free(big);
+    mymalloc_get_stats(&after);
+    printf("    In use grew by at least the request: %s\n",
+           during.bytes_in_use - before.bytes_in_use >= 100 * 64 + (1 << 20) ? "yes" : "no");
+    size_t allocs = 0, frees = 0;
+    for (int cls = 0; cls < MYMALLOC_STAT_CLASSES; cls++) {
+        allocs += during.allocs[cls] - before.allocs[cls];
+        frees += after.frees[cls] - during.frees[cls];
+    }
+    printf("    Counted %zu allocations and %zu frees\n", allocs, frees);
+    fflush(stdout);
+    mymalloc_write_stats(1);
+}
+
+/*
+ * Function: test_profiler
+ * -----------------------
+ * Tests the sampling allocation profiler.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Sample every 4KB on average and allocate 2000 blocks of 100 bytes from one line.
+ * 3. Free every other block, print the profile table and turn sampling off.
+ * 4. Free the remaining blocks.
+ *
+ * Purpose:
+ * - Shows the per-site estimates: about 200000 bytes and 2000 objects for the
+ *   allocation line, about half of them still live.
+ */
+void test_profiler() {
+    printf("Test Profiler:\n");
+    static void *blocks[2000];
+    mymalloc_profile_rate(4096);
+    for (int i = 0; i < 2000; i++) {
+        blocks[i] = malloc(100);
+    }
+    for (int i = 0; i < 2000; i += 2) {
+        free(blocks[i]);
+    }
+    fflush(stdout);
+    mymalloc_write_profile(1, MYMALLOC_PROFILE_TABLE);
+    mymalloc_profile_rate(0);
+    for (int i = 1; i < 2000; i += 2) {
+        free(blocks[i]);
+    }
+}
+
+/*
+ * Function: test_snapshot_diff
+ * ----------------------------
+ * Tests heap snapshots and the per-site diff between them.
+ *
+ * Steps:
+ * 1. Print a message indicating the start of the test.
+ * 2. Take a snapshot, allocate 50 blocks of 200 bytes from one line and take another.
+ * 3. Print the diff between the two snapshots.
+ * 4. Free the blocks and release both snapshots.
+ *
+ * Purpose:
+ * - Shows the allocation line at the top of the diff with +10000 bytes in +50 objects,
+ *   or, with MYMALLOC_TRACK_SITES=0, the same growth charged to "(untracked)".
+ */
+void test_snapshot_diff() {
+    printf("Test Snapshot Diff:\n");
+    void *blocks[50];
+    mymalloc_snapshot *before = mymalloc_snapshot_take();
+    for (int i = 0; i < 50; i++) {
+        blocks[i] = malloc(200);
+    }
+    mymalloc_snapshot *after = mymalloc_snapshot_take();
+    fflush(stdout);
+    mymalloc_snapshot_diff(before, after, 1);
+    for (int i = 0; i < 50; i++) {
+        free(blocks[i]);
+    }
+    mymalloc_snapshot_release(before);
+    mymalloc_snapshot_release(after);
+}
+
 /*
  * Function: test_stress_random_sizes
  * -----------------------------------
@@ -389,9 +1606,11 @@ void test_intentional_leak() {
  * The main function runs all the test functions.
  *
  * Steps:
- * 1. Seed the random number generator using srand.
+ * 1. Seed the random number generator using srand, and track allocation sites unless
+ *    MYMALLOC_TRACK_SITES is already set (run with MYMALLOC_TRACK_SITES=0 for the default layout).
  * 2. Call each test function in sequence.
- * 3. Uncomment specific test functions as needed, especially those that may cause crashes.
+ * 3. Uncomment specific test functions as needed, especially those that may cause crashes;
+ *    the checked build runs the invalid free and guard tests itself.
  * 4. Return 0 to indicate successful execution.
  *
  * Purpose:
@@ -400,17 +1619,49 @@ void test_intentional_leak() {
  */
 int main() {
     srand((unsigned int)time(NULL)); // Seed the random number generator
+    setenv("MYMALLOC_TRACK_SITES", "1", 0);
     
     test_basic_allocation();
     test_exhaustive_allocation();
     test_free_coalescing();
+    test_size_class_reuse();
+    test_quick_lists();
     test_double_free();
     test_zero_size_allocation();
     test_free_null_pointer();
+#ifdef MYMALLOC_DEBUG
+    test_free_invalid_pointer();
+    test_guard_checks();
+#else
     // Uncomment the next line to test invalid free (may cause crash)
     // test_free_invalid_pointer();
+#endif
     test_alignment();
     test_large_allocation();
+    test_mapped_allocation();
+    test_realloc_in_place();
+    test_calloc();
+    test_aligned_allocation();
+    test_usable_size();
+#ifdef MYMALLOC_PRELOAD
+    test_preload_alignment();  // Only the preload build has the exported entry points
+#endif
+#ifndef MYMALLOC_DEBUG
+    test_tiny_blocks();  // The checked build gives every block a chunk
+#endif
+    test_arena_growth();
+    test_placement_policies();
+    test_best_fit_tree();
+    test_arena_pages();
+    test_trace();
+    test_heap_layout();
+    test_threaded_allocation();
+    test_remote_free();
+    test_slab_cache();
+    test_region();
+    test_stats();
+    test_profiler();
+    test_snapshot_diff();
     test_stress_random_sizes();
     // Uncomment the next line to test intentional memory leak
     // test_intentional_leak();